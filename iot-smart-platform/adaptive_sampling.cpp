@@ -0,0 +1,90 @@
+
+#include "mbed.h"
+#include <math.h>
+#include <debug_print.h>
+#include <adaptive_sampling.h>
+
+void Sampler_vInit(TSampler *_ptSampler)
+{
+    memset(_ptSampler, 0, sizeof(TSampler));
+    if(Sampler_iConfigure(_ptSampler, SAMPLE_BASE_SEC, SAMPLE_MIN_SEC, SAMPLE_MAX_SEC) != 0) {
+        // Bad macros, fall back to a fixed period
+        _ptSampler->uiBaseSec = _ptSampler->uiMinSec = _ptSampler->uiMaxSec = 10;
+        _ptSampler->uiPeriodSec = 10;
+    }
+}
+
+// New bounds restart the controller from the base period
+int Sampler_iConfigure(TSampler *_ptSampler, unsigned int _uiBaseSec, unsigned int _uiMinSec, unsigned int _uiMaxSec)
+{
+    if(_uiMinSec == 0 || _uiMinSec > _uiBaseSec || _uiBaseSec > _uiMaxSec || _uiMaxSec > SAMPLE_LIMIT_SEC) {
+        print_function("Invalid sampling config base:%u min:%u max:%u\n", _uiBaseSec, _uiMinSec, _uiMaxSec);
+        return -1;
+    }
+
+    if(_ptSampler->uiBaseSec != _uiBaseSec || _ptSampler->uiMinSec != _uiMinSec || _ptSampler->uiMaxSec != _uiMaxSec) {
+        print_function("Sampling base:%u min:%u max:%u s\n", _uiBaseSec, _uiMinSec, _uiMaxSec);
+        _ptSampler->uiBaseSec = _uiBaseSec;
+        _ptSampler->uiMinSec = _uiMinSec;
+        _ptSampler->uiMaxSec = _uiMaxSec;
+        _ptSampler->uiPeriodSec = _uiBaseSec;
+        _ptSampler->uiStableCnt = 0;
+    }
+    return 0;
+}
+
+// Feed a reading, returns the seconds to wait for the next one
+unsigned int Sampler_uiUpdate(TSampler *_ptSampler, float _fTemperature, uint16_t _u16Humidity)
+{
+    float fScale, fTempScore, fHumiScore;
+    unsigned int uiPeriodSec = _ptSampler->uiPeriodSec;
+
+    if(!_ptSampler->iHasLast) {
+        _ptSampler->iHasLast = 1;
+        _ptSampler->fLastTemperature = _fTemperature;
+        _ptSampler->u16LastHumidity = _u16Humidity;
+        return uiPeriodSec;
+    }
+
+    //
+    // Change since the last reading relative to the thresholds. Below the
+    // base period it is scaled up to one base period, above it the change
+    // itself counts, so a long period never hides a threshold sized step.
+    //
+    fScale = (uiPeriodSec < _ptSampler->uiBaseSec) ? (float)_ptSampler->uiBaseSec / uiPeriodSec : 1.0f;
+    fTempScore = fabsf(_fTemperature - _ptSampler->fLastTemperature) * fScale / SAMPLE_TEMP_DELTA;
+    fHumiScore = abs((int)_u16Humidity - (int)_ptSampler->u16LastHumidity) * fScale / SAMPLE_HUMI_DELTA;
+    _ptSampler->fLastTemperature = _fTemperature;
+    _ptSampler->u16LastHumidity = _u16Humidity;
+
+    if(fTempScore >= 1.0f || fHumiScore >= 1.0f) {
+        // React at once
+        _ptSampler->uiStableCnt = 0;
+        uiPeriodSec /= 2;
+    }
+    else if(fTempScore < 0.5f && fHumiScore < 0.5f) {
+        // Back off slowly, a single quiet reading proves little
+        if(++_ptSampler->uiStableCnt >= SAMPLE_STABLE_CNT) {
+            _ptSampler->uiStableCnt = 0;
+            uiPeriodSec += (uiPeriodSec + 1) / 2;
+        }
+    }
+    else {
+        _ptSampler->uiStableCnt = 0;
+    }
+
+    if(uiPeriodSec < _ptSampler->uiMinSec) {
+        uiPeriodSec = _ptSampler->uiMinSec;
+    }
+    if(uiPeriodSec > _ptSampler->uiMaxSec) {
+        uiPeriodSec = _ptSampler->uiMaxSec;
+    }
+#if SPLAT_DEBUG
+    if(uiPeriodSec != _ptSampler->uiPeriodSec) {
+        print_function("Sample period %u -> %u s\n", _ptSampler->uiPeriodSec, uiPeriodSec);
+    }
+#endif // SPLAT_DEBUG
+    _ptSampler->uiPeriodSec = uiPeriodSec;
+
+    return uiPeriodSec;
+}
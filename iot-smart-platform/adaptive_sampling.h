@@ -0,0 +1,56 @@
+#ifndef __ADAPTIVE_SAMPLING_H__
+#define __ADAPTIVE_SAMPLING_H__
+
+#include <mbed.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//
+// Sample period controller. The period is halved as soon as a reading moves
+// by SAMPLE_TEMP_DELTA or SAMPLE_HUMI_DELTA since the last one (or that much
+// per base period while sampling faster than the base period), and is
+// stretched by half again after SAMPLE_STABLE_CNT quiet readings in a row,
+// always within [SAMPLE_MIN_SEC, SAMPLE_MAX_SEC]. The bounds and the base
+// period can be overridden from the macros of mbed_app.json and at run time
+// from the cloud, see Sampler_iConfigure.
+//
+#ifndef SAMPLE_BASE_SEC
+#define SAMPLE_BASE_SEC             10
+#endif
+#ifndef SAMPLE_MIN_SEC
+#define SAMPLE_MIN_SEC              5
+#endif
+#ifndef SAMPLE_MAX_SEC
+#define SAMPLE_MAX_SEC              300
+#endif
+
+#define SAMPLE_TEMP_DELTA           0.5f    // Celsius per base period
+#define SAMPLE_HUMI_DELTA           2       // Percent per base period
+#define SAMPLE_STABLE_CNT           3
+#define SAMPLE_CONFIG_SENSOR        "sampling"  // value: ["base","min","max"] in seconds
+#define SAMPLE_CONFIG_SEC           600     // How often the cloud config is read
+#define SAMPLE_LIMIT_SEC            86400   // Longest period accepted in a config, a day
+
+typedef struct _TSampler{
+    unsigned int uiBaseSec;
+    unsigned int uiMinSec;
+    unsigned int uiMaxSec;
+    unsigned int uiPeriodSec;   // Wait before the next reading
+    unsigned int uiStableCnt;   // Quiet readings in a row
+    int iHasLast;
+    float fLastTemperature;
+    uint16_t u16LastHumidity;
+}TSampler;
+
+void Sampler_vInit(TSampler *_ptSampler);
+int Sampler_iConfigure(TSampler *_ptSampler, unsigned int _uiBaseSec, unsigned int _uiMinSec, unsigned int _uiMaxSec);
+unsigned int Sampler_uiUpdate(TSampler *_ptSampler, float _fTemperature, uint16_t _u16Humidity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // End of __ADAPTIVE_SAMPLING_H__
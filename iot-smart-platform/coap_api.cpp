@@ -19,31 +19,66 @@
 #include "UDPSocket.h"
 #include "CellularLog.h"
 #include "coap_api.h"
+#include "coap_transport.h"
+#include "coap_endpoint.h"
 #include "debug_print.h"
 
 // Number of retries /
 #define RETRY_COUNT 3
 
+#define DOT_THREAD_STACK_SIZE 512
+
 // CellularInterface object
 NetworkInterface *iface;
 
-// Socket to talk CoAP over
-UDPSocket socket;
+// Transport to talk CoAP over, UDP socket unless recording or replaying
+static const TCoapTransport *g_ptTransport = NULL;
+
+// Transport for coap_post_bulk, NULL when bulk uploads go over g_ptTransport too
+static const TCoapTransport *g_ptBulkTransport = NULL;
+#if COAP_TCP_BULK
+static Thread *g_ptBulkThread = NULL;
+static uint8_t g_u8BulkRecvBuf[COAP_TCP_MAX_MSG_SIZE];
+#endif // COAP_TCP_BULK
 
+#if !COAP_EVENT_LOOP
 // Thread to receive messages over CoAP
 Thread recvfromThread;
+#endif // !COAP_EVENT_LOOP
 
 // CoAP
 struct coap_s* coapHandle;
 coap_version_e coapVersion = COAP_VERSION_1;
 static Mutex g_tRecvMutex;
-static unsigned int g_uiRecvCnt = 0;
 static uint8_t* g_pu8RecvBuf = NULL;
-static uint16_t g_u16RecvLen = 0;
+
+// Outstanding requests, responses are matched by message ID
+static TCoapTransaction g_tTrans[COAP_TRANSACTION_NUM];
+static SocketAddress g_tTransAddr[COAP_TRANSACTION_NUM];
+static EventFlags g_tTransFlags;
+#define COAP_TRANS_FLAG_SLOT    (1UL << 30)     // A request to some endpoint completed
+static uint16_t g_u16MsgId = 0;
+
+// Guarded by g_tRecvMutex
+static TCoapPathStats g_tPathStats[COAP_PATH_NUM];
+static uint64_t g_u64InitMs = 0;
 
 static rtos::Mutex PrintMutex;
+
+#if COAP_EVENT_LOOP
+// Dots are printed from the shared event queue while connecting
+static int dot_event_id = 0;
+
+void dot_event()
+{
+    PrintMutex.lock();
+    printf(".");
+    fflush(stdout);
+    PrintMutex.unlock();
+}
+#else
 static int dot_exit = 0;
-Thread dot_thread(osPriorityNormal, 512);
+Thread dot_thread(osPriorityNormal, DOT_THREAD_STACK_SIZE);
 
 void dot_event()
 {
@@ -60,41 +95,355 @@ void dot_event()
         }
     }
 }
+#endif // COAP_EVENT_LOOP
 
-static void coap_set_recv_len(uint16_t _u16Len)
+static int coap_trans_alloc(uint8_t *_pu8Payload, uint16_t _u16PayloadSize)
 {
+    TCoapTransaction *ptTrans;
+    int i;
+
     g_tRecvMutex.lock();
-    g_u16RecvLen = _u16Len;
-    g_tRecvMutex.unlock();    
+    for(i = 0; i < COAP_TRANSACTION_NUM; i++) {
+        ptTrans = &g_tTrans[i];
+        if(ptTrans->u8State != COAP_TRANS_FREE) {
+            continue;
+        }
+        memset(ptTrans, 0, sizeof(TCoapTransaction));
+        ptTrans->u8State = COAP_TRANS_PENDING;
+        ptTrans->u16MsgId = g_u16MsgId++;
+        ptTrans->pu8Payload = _pu8Payload;
+        ptTrans->u16PayloadSize = _u16PayloadSize;
+        ptTrans->i8Endpoint = -1;
+        g_tTransFlags.clear(1UL << i);
+        g_tRecvMutex.unlock();
+        return i;
+    }
+    g_tRecvMutex.unlock();
+
+    print_function("No free CoAP transaction!\n");
+    return -1;
+}
+
+// Call with g_tRecvMutex held
+static void coap_trans_release(TCoapTransaction *_ptTrans)
+{
+    if(_ptTrans->iRtxEvent != 0) {
+        mbed_event_queue()->cancel(_ptTrans->iRtxEvent);
+        _ptTrans->iRtxEvent = 0;
+    }
+    if(_ptTrans->pu8Msg != NULL) {
+        free(_ptTrans->pu8Msg);
+        _ptTrans->pu8Msg = NULL;
+    }
+    _ptTrans->u8State = COAP_TRANS_FREE;
+    g_tTransFlags.set(COAP_TRANS_FLAG_SLOT);
+}
+
+static void coap_trans_free(int _iTrans)
+{
+    g_tRecvMutex.lock();
+    coap_trans_release(&g_tTrans[_iTrans]);
+    g_tRecvMutex.unlock();
+}
+
+//
+// Retransmit a confirmable request that is still unanswered, on the shared
+// event queue. The tag carries the message ID so a late event does not hit
+// a transaction that was reused.
+//
+static void coap_rtx_event(int _iTag)
+{
+    TCoapTransaction *ptTrans = &g_tTrans[_iTag & 0xFF];
+    SocketAddress addr;
+    uint8_t *pu8Msg;
+    uint16_t u16MsgLen;
+
+    g_tRecvMutex.lock();
+    if(ptTrans->u8State != COAP_TRANS_PENDING || ptTrans->u16MsgId != (uint16_t)(_iTag >> 8) || ptTrans->u8Acked) {
+        g_tRecvMutex.unlock();
+        return;
+    }
+    ptTrans->iRtxEvent = 0;
+
+    if(ptTrans->u8RtxCnt >= COAP_MAX_RETRANSMIT) {
+        ptTrans->u8State = COAP_TRANS_FAILED;
+        g_tTransFlags.set((1UL << (_iTag & 0xFF)) | COAP_TRANS_FLAG_SLOT);
+        g_tRecvMutex.unlock();
+        return;
+    }
+
+    ptTrans->u8RtxCnt++;
+    ptTrans->u32TimeoutMs = ptTrans->u32TimeoutMs * ptTrans->u8BackoffX2 / 2;
+#if COAP_API_DEBUG
+    print_function("Retransmit message id %d (%d), next timeout %lu ms\n",
+                ptTrans->u16MsgId, ptTrans->u8RtxCnt, (unsigned long)ptTrans->u32TimeoutMs);
+#endif // COAP_API_DEBUG
+    ptTrans->iRtxEvent = mbed_event_queue()->call_in(ptTrans->u32TimeoutMs, coap_rtx_event, _iTag);
+
+    // Send a copy after unlocking, the transaction may be answered and released meanwhile
+    u16MsgLen = ptTrans->u16MsgLen;
+    pu8Msg = (uint8_t *)malloc(u16MsgLen);
+    if(pu8Msg != NULL) {
+        memcpy(pu8Msg, ptTrans->pu8Msg, u16MsgLen);
+        g_tPathStats[COAP_PATH_UDP].u64TxBytes += u16MsgLen;
+    }
+    addr = g_tTransAddr[_iTag & 0xFF];
+    g_tRecvMutex.unlock();
+
+    // Out of memory counts as a lost datagram, the next timeout tries again
+    if(pu8Msg != NULL) {
+        g_ptTransport->pfnSendTo(addr, pu8Msg, u16MsgLen);
+        free(pu8Msg);
+    }
 }
 
-sn_coap_hdr_s* coap_get_parser_obj(uint8_t *_pu8RecvBuf, uint16_t _u16Len)
+//
+// Take one of the endpoint's NSTART slots for the transaction, waits while
+// all are busy. Urgent requests may also take COAP_NSTART_RESERVED slots on
+// top, so an alarm does not queue behind a full window of routine uploads.
+//
+static int coap_nstart_acquire(int _iTrans, int _iEp, int _iUrgent)
 {
-    return sn_coap_parser(coapHandle, _u16Len, _pu8RecvBuf, &coapVersion);
+    uint64_t u64EndMs = Kernel::get_ms_count() + COAP_NSTART_WAIT_MS;
+    unsigned int uiNstart, uiBusy;
+    int i;
+
+    while(1) {
+        uiNstart = coap_endpoint_nstart(_iEp);
+        if(_iUrgent) {
+            uiNstart += COAP_NSTART_RESERVED;
+        }
+
+        g_tRecvMutex.lock();
+        uiBusy = 0;
+        // Acknowledged requests only wait for their separate response, they are not outstanding
+        for(i = 0; i < COAP_TRANSACTION_NUM; i++) {
+            if(g_tTrans[i].u8State == COAP_TRANS_PENDING && g_tTrans[i].i8Endpoint == _iEp && !g_tTrans[i].u8Acked) {
+                uiBusy++;
+            }
+        }
+        if(uiBusy < uiNstart) {
+            g_tTrans[_iTrans].i8Endpoint = (int8_t)_iEp;
+            g_tRecvMutex.unlock();
+            return 0;
+        }
+        g_tRecvMutex.unlock();
+
+        if(Kernel::get_ms_count() >= u64EndMs) {
+            print_function("%d requests in flight, NSTART %d\n", uiBusy, uiNstart);
+            return -1;
+        }
+        g_tTransFlags.wait_any(COAP_TRANS_FLAG_SLOT, 100);
+    }
 }
 
-void coap_get_recvcnt(uint16_t *_pu16Len, unsigned int *_puiCnt)
+//
+// Parse a received datagram and complete the request it answers. ACKs and
+// resets are matched by message ID. An empty ACK only stops retransmission:
+// the server sends the response later in a CON or NON message with its own
+// message ID (a separate response, RFC 7252 5.2.2), matched by the token,
+// and a CON one is acknowledged.
+//
+static void coap_handle_datagram(uint8_t *_pu8Buf, uint16_t _u16Len, const SocketAddress &_tAddr)
 {
+    sn_coap_hdr_s *parsed;
+    TCoapTransaction *ptTrans;
+    uint16_t u16Copy, u16Token = 0;
+    uint8_t aReply[4];
+    int i, iSeparate;
+
+    parsed = sn_coap_parser(coapHandle, _u16Len, _pu8Buf, &coapVersion);
+    if(parsed == NULL) {
+        print_function("Parse CoAP message failed, len:%d\n", _u16Len);
+        return;
+    }
+
+    // Our requests carry their message ID as a 2-byte token, see coap_send_request
+    iSeparate = (parsed->msg_type == COAP_MSG_TYPE_CONFIRMABLE || parsed->msg_type == COAP_MSG_TYPE_NON_CONFIRMABLE);
+    if(parsed->token_len == 2 && parsed->token_ptr != NULL) {
+        u16Token = (uint16_t)(parsed->token_ptr[0] << 8 | parsed->token_ptr[1]);
+    }
+
     g_tRecvMutex.lock();
-    *_puiCnt = g_uiRecvCnt;
-    *_pu16Len = g_u16RecvLen;
+    for(i = 0; i < COAP_TRANSACTION_NUM; i++) {
+        ptTrans = &g_tTrans[i];
+        if(ptTrans->u8State != COAP_TRANS_PENDING) {
+            continue;
+        }
+        if(iSeparate ? (parsed->token_len != 2 || u16Token != ptTrans->u16MsgId) : (ptTrans->u16MsgId != parsed->msg_id)) {
+            continue;
+        }
+
+        if(ptTrans->iRtxEvent != 0) {
+            mbed_event_queue()->cancel(ptTrans->iRtxEvent);
+            ptTrans->iRtxEvent = 0;
+        }
+        if(parsed->msg_type == COAP_MSG_TYPE_ACKNOWLEDGEMENT && parsed->msg_code == COAP_MSG_CODE_EMPTY) {
+            // The ACK times the round trip, the response may take the server a while
+            ptTrans->u8Acked = 1;
+            ptTrans->u32RttMs = (uint32_t)(Kernel::get_ms_count() - ptTrans->u64SentMs);
+            g_tTransFlags.set(COAP_TRANS_FLAG_SLOT);
+            break;
+        }
+
+        ptTrans->u16MsgCode = parsed->msg_code;
+        ptTrans->u16PayloadLen = parsed->payload_len;
+        if(ptTrans->pu8Payload != NULL && ptTrans->u16PayloadSize > 0) {
+            // Keep room for the terminating null, callers treat payloads as strings
+            u16Copy = parsed->payload_len;
+            if(u16Copy >= ptTrans->u16PayloadSize) {
+                u16Copy = ptTrans->u16PayloadSize - 1;
+            }
+            memcpy(ptTrans->pu8Payload, parsed->payload_ptr, u16Copy);
+            ptTrans->pu8Payload[u16Copy] = '\0';
+        }
+        if(!ptTrans->u8Acked) {
+            ptTrans->u32RttMs = (uint32_t)(Kernel::get_ms_count() - ptTrans->u64SentMs);
+        }
+        // The parser sets max_age to the default of 60 s when the option is absent
+        ptTrans->u32MaxAge = COAP_MAX_AGE_DEFAULT;
+        if(parsed->options_list_ptr != NULL) {
+            ptTrans->u32MaxAge = parsed->options_list_ptr->max_age;
+            if(parsed->options_list_ptr->etag_ptr != NULL && parsed->options_list_ptr->etag_len <= COAP_ETAG_MAX_LEN) {
+                ptTrans->u8ETagLen = parsed->options_list_ptr->etag_len;
+                memcpy(ptTrans->u8ETag, parsed->options_list_ptr->etag_ptr, ptTrans->u8ETagLen);
+            }
+        }
+        ptTrans->u8State = COAP_TRANS_DONE;
+        g_tTransFlags.set((1UL << i) | COAP_TRANS_FLAG_SLOT);
+        break;
+    }
     g_tRecvMutex.unlock();
+
+    //
+    // A CON message gets an ACK, or a reset when no request waits for it
+    // (RFC 7252 4.2). That stops the server's retransmissions, also of a
+    // response whose first ACK from us was lost.
+    //
+    if(parsed->msg_type == COAP_MSG_TYPE_CONFIRMABLE) {
+        aReply[0] = COAP_VERSION_1 | ((i < COAP_TRANSACTION_NUM) ? COAP_MSG_TYPE_ACKNOWLEDGEMENT : COAP_MSG_TYPE_RESET);
+        aReply[1] = COAP_MSG_CODE_EMPTY;
+        aReply[2] = (uint8_t)(parsed->msg_id >> 8);
+        aReply[3] = (uint8_t)(parsed->msg_id & 0xFF);
+        g_ptTransport->pfnSendTo(_tAddr, aReply, sizeof(aReply));
+    }
+
+#if COAP_API_DEBUG
+    if(i >= COAP_TRANSACTION_NUM) {
+        print_function("Drop message id %d, no request waiting for it\n", parsed->msg_id);
+    }
+#endif // COAP_API_DEBUG
+
+    sn_coap_parser_release_allocated_coap_msg_mem(coapHandle, parsed);
 }
 
-void coap_inc_recvcnt(void)
+//
+// Wait until the request is answered or has failed. _u32TimeoutMs does not
+// cut the retransmissions short, at a grown RTO they outlast any fixed limit
+// and the last timer marks the request FAILED itself. It bounds what has no
+// schedule: a separate response, counted from the empty ACK, and TCP requests.
+//
+static int coap_trans_wait(int _iTrans, uint32_t _u32TimeoutMs, TCoapTransaction *_ptResult)
 {
+    TCoapTransaction *ptTrans;
+    uint64_t u64DeadlineMs, u64NowMs;
+    uint32_t u32Flags;
+    int iRet = -1;
+
+    if(_iTrans < 0 || _iTrans >= COAP_TRANSACTION_NUM) {
+        return -1;
+    }
+    ptTrans = &g_tTrans[_iTrans];
+
+    u64DeadlineMs = Kernel::get_ms_count() + _u32TimeoutMs;
+    while(1) {
+        u64NowMs = Kernel::get_ms_count();
+        u32Flags = g_tTransFlags.wait_any(1UL << _iTrans, (u64DeadlineMs > u64NowMs) ? (uint32_t)(u64DeadlineMs - u64NowMs) : 0);
+        if(!(u32Flags & osFlagsError)) {
+            break;
+        }
+
+        g_tRecvMutex.lock();
+        u64NowMs = Kernel::get_ms_count();
+        if(ptTrans->u8State != COAP_TRANS_PENDING) {
+            g_tRecvMutex.unlock();
+            break;
+        }
+        if(ptTrans->iRtxEvent != 0) {
+            // The next timer fires within the current timeout
+            u64DeadlineMs = u64NowMs + ptTrans->u32TimeoutMs;
+        }
+        else if(ptTrans->u8Acked && ptTrans->u64SentMs + ptTrans->u32RttMs + _u32TimeoutMs > u64NowMs) {
+            u64DeadlineMs = ptTrans->u64SentMs + ptTrans->u32RttMs + _u32TimeoutMs;
+        }
+        else {
+            g_tRecvMutex.unlock();
+            break;
+        }
+        g_tRecvMutex.unlock();
+    }
+
     g_tRecvMutex.lock();
-    g_uiRecvCnt++;
+    if(_ptResult != NULL) {
+        *_ptResult = g_tTrans[_iTrans];
+    }
+    if(g_tTrans[_iTrans].u8State == COAP_TRANS_DONE) {
+        iRet = 0;
+    }
+    coap_trans_release(&g_tTrans[_iTrans]);
     g_tRecvMutex.unlock();
+
+    return iRet;
 }
 
-void coap_dec_recvcnt(void)
+static void coap_path_record(const TCoapTransaction *_ptResult, int _iOk)
 {
+    TCoapPathStats *ptStats;
+
+    if(_ptResult->u8Path >= COAP_PATH_NUM) {
+        return;
+    }
+    ptStats = &g_tPathStats[_ptResult->u8Path];
+
     g_tRecvMutex.lock();
-    g_uiRecvCnt--;
+    if(_iOk) {
+        ptStats->uiOkCnt++;
+        ptStats->u64PayloadBytes += _ptResult->u16ReqPayloadLen;
+        ptStats->u64ExchangeMs += _ptResult->u32RttMs;
+    }
+    else {
+        ptStats->uiFailCnt++;
+    }
     g_tRecvMutex.unlock();
 }
 
+// Wait for the response of a request sent by coap_post/coap_get, the transaction is released afterwards
+int coap_wait_response(int _iTrans, uint32_t _u32TimeoutMs, TCoapTransaction *_ptResult)
+{
+    TCoapTransaction tResult;
+
+    tResult.i8Endpoint = -1;
+    tResult.u8Path = COAP_PATH_NUM;
+    if(coap_trans_wait(_iTrans, _u32TimeoutMs, &tResult) != 0) {
+        coap_path_record(&tResult, 0);
+        coap_endpoint_on_timeout(tResult.i8Endpoint);
+        return -1;
+    }
+
+    coap_path_record(&tResult, 1);
+    coap_endpoint_on_response(tResult.i8Endpoint, tResult.u32RttMs, tResult.u8RtxCnt);
+    if(_ptResult != NULL) {
+        *_ptResult = tResult;
+    }
+    return 0;
+}
+
+void coap_cancel(int _iTrans)
+{
+    if(_iTrans >= 0 && _iTrans < COAP_TRANSACTION_NUM) {
+        coap_trans_free(_iTrans);
+    }
+}
 
 // CoAP HAL
 void* coap_malloc(uint16_t size) 
@@ -129,13 +478,75 @@ void recvfromMain()
     print_function("Start recv thread. \n\n");
 
     // Suggested is to keep packet size under 1280 bytes
-    while ((ret = socket.recvfrom(&addr, g_pu8RecvBuf, 1280)) >= 0) {
-        coap_set_recv_len((uint16_t)ret);
-        coap_inc_recvcnt();
+    while ((ret = g_ptTransport->pfnRecvFrom(&addr, g_pu8RecvBuf, COAP_UDP_MAX_MSG_SIZE)) >= 0) {
+        coap_handle_datagram(g_pu8RecvBuf, (uint16_t)ret, addr);
+    }
+
+    print_function("%s recvfrom failed, error code %d. Shutting down receive thread.\n", g_ptTransport->strName, ret);
+}
+
+#if COAP_TCP_BULK
+// Requests on a lost connection get no answer, fail them now instead of at their timeout
+static void coap_bulk_fail_pending(void)
+{
+    TCoapTransaction *ptTrans;
+    int i;
+
+    g_tRecvMutex.lock();
+    for(i = 0; i < COAP_TRANSACTION_NUM; i++) {
+        ptTrans = &g_tTrans[i];
+        if(ptTrans->u8State == COAP_TRANS_PENDING && ptTrans->u8Path == COAP_PATH_TCP) {
+            ptTrans->u8State = COAP_TRANS_FAILED;
+            g_tTransFlags.set((1UL << i) | COAP_TRANS_FLAG_SLOT);
+        }
     }
+    g_tRecvMutex.unlock();
+}
+
+// Main function for the bulk receive thread, the connection comes and goes underneath
+static void recvBulkMain(void)
+{
+    SocketAddress addr;
+    nsapi_size_or_error_t ret;
 
-    print_function("UDPSocket::recvfrom failed, error code %d. Shutting down receive thread.\n", ret);
+    while(1) {
+        ret = g_ptBulkTransport->pfnRecvFrom(&addr, g_u8BulkRecvBuf, sizeof(g_u8BulkRecvBuf));
+        if(ret >= 0) {
+            coap_handle_datagram(g_u8BulkRecvBuf, (uint16_t)ret, addr);
+        }
+        else if(ret == NSAPI_ERROR_CONNECTION_LOST) {
+            coap_bulk_fail_pending();
+        }
+        else if(ret != NSAPI_ERROR_WOULD_BLOCK && ret != NSAPI_ERROR_NO_CONNECTION) {
+            print_function("%s recvfrom failed, error code %d\n", g_ptBulkTransport->strName, ret);
+            ThisThread::sleep_for(COAP_TCP_POLL_MS);
+        }
+    }
 }
+#endif // COAP_TCP_BULK
+
+#if COAP_EVENT_LOOP
+// Runs on the shared event queue, sigio does not tell how many datagrams are waiting so drain them all
+static void coap_rx_event(void)
+{
+    SocketAddress addr;
+    nsapi_size_or_error_t ret;
+
+    while ((ret = g_ptTransport->pfnRecvFrom(&addr, g_pu8RecvBuf, COAP_UDP_MAX_MSG_SIZE)) >= 0) {
+        coap_handle_datagram(g_pu8RecvBuf, (uint16_t)ret, addr);
+    }
+
+    if (ret != NSAPI_ERROR_WOULD_BLOCK) {
+        print_function("%s recvfrom failed, error code %d\n", g_ptTransport->strName, ret);
+    }
+}
+
+// Called from the network stack, defer the work to the event queue
+static void coap_sigio(void)
+{
+    mbed_event_queue()->call(coap_rx_event);
+}
+#endif // COAP_EVENT_LOOP
 
 /**
  * Connects to the Cellular Network
@@ -151,7 +562,9 @@ nsapi_error_t do_connect()
             print_function("\n\nAuthentication Failure. Exiting application\n");
         } else if (retcode == NSAPI_ERROR_OK) {
             print_function("\n\nConnection Established.\n");
+#if !COAP_EVENT_LOOP
             dot_exit = 0;
+#endif // !COAP_EVENT_LOOP
         } else if (retry_counter > RETRY_COUNT) {
             print_function("\n\nFatal connection failure: %d\n", retcode);
         } else {
@@ -176,6 +589,17 @@ int8_t coap_init(uint8_t* _u8RecvBuf)
         return -1;
     }
        
+#if COAP_TRANSPORT_REPLAY
+    // Replay never touches the network
+    g_ptTransport = coap_transport_replayer();
+    iface = NULL;
+#else
+#if COAP_TRANSPORT_RECORD
+    g_ptTransport = coap_transport_recorder(coap_transport_udp());
+#else
+    g_ptTransport = coap_transport_udp();
+#endif // COAP_TRANSPORT_RECORD
+
     print_function("Establishing connection ");
 
     // sim pin, apn, credentials and possible plmn are taken atuomtically from json when using get_default_instance()
@@ -185,17 +609,35 @@ int8_t coap_init(uint8_t* _u8RecvBuf)
     /* Attempt to connect to a cellular network */    
 #if MBED_CONF_MBED_TRACE_ENABLE
     trace_open();
+#elif COAP_EVENT_LOOP
+    dot_event_id = mbed_event_queue()->call_every(4000, dot_event);
 #else
     dot_thread.start(dot_event);
 #endif // #if MBED_CONF_MBED_TRACE_ENABLE
 
-    if (do_connect() != NSAPI_ERROR_OK) {
+    nsapi_error_t conn = do_connect();
+#if COAP_EVENT_LOOP && !MBED_CONF_MBED_TRACE_ENABLE
+    mbed_event_queue()->cancel(dot_event_id);
+#endif
+    if (conn != NSAPI_ERROR_OK) {
         print_function("\n\nFailure. Exiting \n");    
         return -1;
     }
+#endif // COAP_TRANSPORT_REPLAY
 
-    nsapi_error_t err = socket.open(iface);
-    print_function("Open socket return: %d \n\r", err);
+#if COAP_IMPAIR_LOSS_PCT || COAP_IMPAIR_JITTER_MS
+    // Emulated packet loss and jitter for load tests
+    g_ptTransport = coap_transport_impair(g_ptTransport, COAP_IMPAIR_LOSS_PCT, COAP_IMPAIR_JITTER_MS);
+#endif
+
+    nsapi_error_t err = g_ptTransport->pfnOpen(iface);
+    print_function("Open %s transport return: %d \n\r", g_ptTransport->strName, err);
+    if(err != NSAPI_ERROR_OK) {
+        return -1;
+    }
+
+    // Start from a different message ID on every boot so replies to a previous run are not taken as ours
+    g_u16MsgId = (uint16_t)Kernel::get_ms_count();
 
     // Initialize the CoAP protocol handle, pointing to local implementations on malloc/free/tx/rx functions
     coapHandle = sn_coap_protocol_init(&coap_malloc, &coap_free, &coap_tx_cb, &coap_rx_cb);
@@ -204,64 +646,274 @@ int8_t coap_init(uint8_t* _u8RecvBuf)
         return -1;
     }
 
+#if COAP_EVENT_LOOP
+    // Non-blocking socket driven by sigio on the shared event queue, no receive thread needed
+    g_ptTransport->pfnSetBlocking(false);
+    g_ptTransport->pfnSigio(coap_sigio);
+    // Pick up anything that arrived before sigio was attached
+    mbed_event_queue()->call(coap_rx_event);
+#if COAP_API_DEBUG
+    // From the configured sizes, coap_mem_report measures
+    print_function("Event loop mode, about %d bytes of thread stack and control blocks not used (estimate)\n",
+                (int)(OS_STACK_SIZE + DOT_THREAD_STACK_SIZE + 2 * sizeof(Thread)));
+#endif // COAP_API_DEBUG
+#else
     // UDPSocket::recvfrom is blocking, so run it in a separate RTOS thread
     recvfromThread.start(&recvfromMain);
+#endif // COAP_EVENT_LOOP
+
+#if COAP_TCP_BULK
+#if COAP_EVENT_LOOP || COAP_TRANSPORT_REPLAY
+    print_function("Bulk uploads over UDP, TCP needs the receive thread and the network\n");
+#else
+    // Connected on the first bulk upload
+    g_ptBulkTransport = coap_transport_tcp();
+    g_ptBulkTransport->pfnOpen(iface);
+    g_ptBulkThread = new Thread(osPriorityNormal, COAP_TCP_THREAD_STACK_SIZE);
+    g_ptBulkThread->start(&recvBulkMain);
+#endif // COAP_EVENT_LOOP || COAP_TRANSPORT_REPLAY
+#endif // COAP_TCP_BULK
 
+    // Resolve and probe the cloud endpoints, the fastest one is used
+    if(coap_endpoint_init(iface) != 0) {
+        return -1;
+    }
+
+    g_u64InitMs = Kernel::get_ms_count();
     return 0;
 }
 
-int8_t coap_post(const char* _coap_uri_path, const char* _coap_payload) 
+// Send a request on the bulk connection, reliable so it needs no retransmissions and no NSTART slot.
+// Returns COAP_BULK_FALLBACK, with the message and transaction kept, when the peer cannot take it
+// or the connection is down; the caller sends it over UDP then.
+#define COAP_BULK_FALLBACK      -2
+static int coap_send_bulk(int _iTrans, uint8_t *_pu8Msg, uint16_t _u16MsgLen)
+{
+    TCoapTransaction *ptTrans = &g_tTrans[_iTrans];
+    SocketAddress addr;
+    int scount;
+
+    if(coap_endpoint_current(&addr) < 0) {
+        free(_pu8Msg);
+        coap_trans_free(_iTrans);
+        return -1;
+    }
+
+    g_tRecvMutex.lock();
+    ptTrans->u8Path = COAP_PATH_TCP;
+    ptTrans->u64SentMs = Kernel::get_ms_count();
+    g_tRecvMutex.unlock();
+
+    // Sent without g_tRecvMutex, a connect must not hold up the UDP receive path
+    scount = g_ptBulkTransport->pfnSendTo(addr, _pu8Msg, _u16MsgLen);
+    if(scount < 0) {
+        print_function("%s send failed: %d, use UDP\n", g_ptBulkTransport->strName, scount);
+        g_tRecvMutex.lock();
+        ptTrans->u8Path = COAP_PATH_UDP;
+        g_tRecvMutex.unlock();
+        return COAP_BULK_FALLBACK;
+    }
+    free(_pu8Msg);
+#if COAP_API_DEBUG
+    print_function("Sent %d bytes to coap server over %s\n\r", scount, g_ptBulkTransport->strName);
+#endif // COAP_API_DEBUG
+
+    g_tRecvMutex.lock();
+    g_tPathStats[COAP_PATH_TCP].uiReqCnt++;
+    g_tPathStats[COAP_PATH_TCP].u64TxBytes += _u16MsgLen;
+    g_tRecvMutex.unlock();
+    return _iTrans;
+}
+
+// Build the request, take a transaction for it and send it to the current endpoint
+static int coap_send_request(sn_coap_hdr_s *_ptHdr, uint8_t *_pu8Payload, uint16_t _u16PayloadSize, int _iPath, int _iUrgent)
 {
     uint16_t message_len;
     uint8_t* message_ptr;
-    int scount;
+    int scount, iTrans, iEp;
+    uint32_t u32RtoMs;
+    uint16_t u16MsgId;
+    SocketAddress addr;
+    TCoapTransaction *ptTrans;
+    uint8_t aToken[2];
 
-    // See ns_coap_header.h
-    sn_coap_hdr_s *coap_res_ptr = (sn_coap_hdr_s*)calloc(sizeof(sn_coap_hdr_s), 1);
-    coap_res_ptr->uri_path_ptr = (uint8_t*)_coap_uri_path;        // Path
-    coap_res_ptr->uri_path_len = strlen(_coap_uri_path);   
-    coap_res_ptr->msg_code = COAP_MSG_CODE_REQUEST_POST;        // CoAP method
-    coap_res_ptr->payload_len = strlen(_coap_payload);          // Body length
-    coap_res_ptr->payload_ptr = (uint8_t*)_coap_payload;          // Body pointer
-    coap_res_ptr->content_format = COAP_CT_TEXT_PLAIN;          // CoAP content type
-    coap_res_ptr->options_list_ptr = 0;                         // Optional: options list
-    
-    // Message ID is used to track request->response patterns, because we're using UDP (so everything is unconfirmed).
-    // See the receive code to verify that we get the same message ID back
-    coap_res_ptr->msg_id = 7;
+    iTrans = coap_trans_alloc(_pu8Payload, _u16PayloadSize);
+    if(iTrans < 0) {
+        return -1;
+    }
+
+    //
+    // Message ID is used to track request->response patterns, see
+    // coap_handle_datagram. It goes in the token as well, a separate response
+    // has a message ID of its own.
+    //
+    _ptHdr->msg_id = g_tTrans[iTrans].u16MsgId;
+    aToken[0] = (uint8_t)(_ptHdr->msg_id >> 8);
+    aToken[1] = (uint8_t)(_ptHdr->msg_id & 0xFF);
+    _ptHdr->token_ptr = aToken;
+    _ptHdr->token_len = sizeof(aToken);
+    g_tTrans[iTrans].u16ReqPayloadLen = _ptHdr->payload_len;
 
     // Calculate the CoAP message size, allocate the memory and build the message
-    message_len = sn_coap_builder_calc_needed_packet_data_size(coap_res_ptr);
+    message_len = sn_coap_builder_calc_needed_packet_data_size(_ptHdr);
 #if COAP_API_DEBUG
     print_function("Calculated message length: %d bytes\n\r", message_len);
 #endif // COAP_API_DEBUG
 
     message_ptr = (uint8_t*)malloc(message_len);
-    
-    sn_coap_builder(message_ptr, coap_res_ptr);
+    if(message_ptr == NULL) {
+        coap_trans_free(iTrans);
+        return -1;
+    }
+    sn_coap_builder(message_ptr, _ptHdr);
+
+#if COAP_API_RAW_DEBUG
+    print_function("Message is: ");
+    for (size_t ix = 0; ix < message_len; ix++) {
+         print_function("%02x ", message_ptr[ix]);
+    }
+     print_function("\n\r");
+#endif // COAP_API_RAW_DEBUG
+
+    coap_endpoint_tick();
+    if(_iPath == COAP_PATH_TCP && g_ptBulkTransport != NULL) {
+        scount = coap_send_bulk(iTrans, message_ptr, message_len);
+        if(scount != COAP_BULK_FALLBACK) {
+            return scount;
+        }
+        // Too large for the peer or no connection, send it as a datagram
+    }
+
+    // Not fragmented at the IP layer, a bulk sender splits its batch on this
+    if(message_len > COAP_UDP_MAX_MSG_SIZE) {
+        print_function("%d bytes over the datagram budget of %d\n", message_len, COAP_UDP_MAX_MSG_SIZE);
+        free(message_ptr);
+        coap_trans_free(iTrans);
+        return COAP_ERR_TOO_LARGE;
+    }
+
+    iEp = coap_endpoint_current(&addr);
+    if(iEp < 0 || coap_nstart_acquire(iTrans, iEp, _iUrgent) != 0) {
+        free(message_ptr);
+        coap_trans_free(iTrans);
+        return -1;
+    }
+
+    //
+    // First timeout is the RTO dithered by up to half, the variable backoff
+    // factor keeps the retransmission window sane for very small and very
+    // large RTOs
+    //
+    u32RtoMs = coap_endpoint_rto(iEp);
+
+    g_tRecvMutex.lock();
+    ptTrans = &g_tTrans[iTrans];
+    ptTrans->pu8Msg = message_ptr;
+    ptTrans->u16MsgLen = message_len;
+    ptTrans->u32TimeoutMs = u32RtoMs + rand() % (u32RtoMs / 2 + 1);
+    ptTrans->u8BackoffX2 = (u32RtoMs < 1000) ? 6 : ((u32RtoMs > 3000) ? 3 : 4);
+    g_tTransAddr[iTrans] = addr;
+    ptTrans->u64SentMs = Kernel::get_ms_count();
+    u16MsgId = ptTrans->u16MsgId;
+    g_tRecvMutex.unlock();
+
+    // Sent without g_tRecvMutex, a slow send must not hold up the receive path
+    scount = g_ptTransport->pfnSendTo(addr, message_ptr, message_len);
+
+    //
+    // The answer may have come in the meantime, and the waiter may even have
+    // released the transaction, so only arm the timer for our own request
+    // while it still waits for its first answer
+    //
+    g_tRecvMutex.lock();
+    if(scount >= 0) {
+        if(ptTrans->u8State == COAP_TRANS_PENDING && ptTrans->u16MsgId == u16MsgId && !ptTrans->u8Acked) {
+            ptTrans->iRtxEvent = mbed_event_queue()->call_in(ptTrans->u32TimeoutMs, coap_rtx_event, (int)(u16MsgId << 8 | iTrans));
+        }
+        g_tPathStats[COAP_PATH_UDP].uiReqCnt++;
+        g_tPathStats[COAP_PATH_UDP].u64TxBytes += message_len;
+    }
+    g_tRecvMutex.unlock();
 #if COAP_API_DEBUG
-    print_function("payload: %s\n\r", _coap_payload);
+    print_function("Sent %d bytes to coap server, rto %lu ms\n\r", scount, (unsigned long)u32RtoMs);
 #endif // COAP_API_DEBUG
 
-    scount = socket.sendto(SERVER_IP_ADDR, UDP_SOCKET_PORT, message_ptr, message_len);
+    if(scount < 0) {
+        coap_trans_free(iTrans);
+        return -1;
+    }
+    return iTrans;
+}
+
+static int coap_post_path(const char* _coap_uri_path, const char* _coap_payload, uint8_t* _pu8Resp, uint16_t _u16RespSize, int _iPath, int _iUrgent)
+{
+    int iTrans;
+
+    // See ns_coap_header.h
+    sn_coap_hdr_s *coap_res_ptr = (sn_coap_hdr_s*)calloc(sizeof(sn_coap_hdr_s), 1);
+    if(coap_res_ptr == NULL) {
+        return -1;
+    }
+    coap_res_ptr->uri_path_ptr = (uint8_t*)_coap_uri_path;        // Path
+    coap_res_ptr->uri_path_len = strlen(_coap_uri_path);   
+    coap_res_ptr->msg_code = COAP_MSG_CODE_REQUEST_POST;        // CoAP method
+    coap_res_ptr->payload_len = strlen(_coap_payload);          // Body length
+    coap_res_ptr->payload_ptr = (uint8_t*)_coap_payload;          // Body pointer
+    coap_res_ptr->content_format = COAP_CT_TEXT_PLAIN;          // CoAP content type
+    coap_res_ptr->options_list_ptr = 0;                         // Optional: options list
 #if COAP_API_DEBUG
-    print_function("Sent %d bytes to coap server\n\r", scount);
+    print_function("payload: %s\n\r", _coap_payload);
 #endif // COAP_API_DEBUG
 
+    iTrans = coap_send_request(coap_res_ptr, _pu8Resp, _u16RespSize, _iPath, _iUrgent);
     free(coap_res_ptr);
-    free(message_ptr);
 
-    return 0;
+    return iTrans;
 }
 
-int8_t coap_get(const char* _coap_uri_path) 
+// Returns the transaction to pass to coap_wait_response, or -1.
+// The response payload is copied to _pu8Resp, which may be NULL when only the code matters.
+int coap_post(const char* _coap_uri_path, const char* _coap_payload, uint8_t* _pu8Resp, uint16_t _u16RespSize)
 {
-    uint16_t message_len;
-    uint8_t* message_ptr;
-    int scount;
+    return coap_post_path(_coap_uri_path, _coap_payload, _pu8Resp, _u16RespSize, COAP_PATH_UDP, 0);
+}
+
+// As coap_post, for large batched uploads. With COAP_TCP_BULK they go over one
+// persistent CoAP-over-TCP connection in a single message, no block-wise
+// transfer; otherwise over UDP like any other request. Returns
+// COAP_ERR_TOO_LARGE when it ends up on UDP and does not fit a datagram.
+int coap_post_bulk(const char* _coap_uri_path, const char* _coap_payload, uint8_t* _pu8Resp, uint16_t _u16RespSize)
+{
+    return coap_post_path(_coap_uri_path, _coap_payload, _pu8Resp, _u16RespSize, COAP_PATH_TCP, 0);
+}
+
+// Whether bulk uploads go over TCP now, so batches need not fit a datagram
+int coap_bulk_over_tcp(void)
+{
+    return g_ptBulkTransport != NULL && coap_tcp_ready();
+}
+
+// As coap_post, for alarms. They go over UDP and may use the reserved NSTART slot.
+int coap_post_alarm(const char* _coap_uri_path, const char* _coap_payload, uint8_t* _pu8Resp, uint16_t _u16RespSize)
+{
+    return coap_post_path(_coap_uri_path, _coap_payload, _pu8Resp, _u16RespSize, COAP_PATH_UDP, 1);
+}
+
+int coap_get(const char* _coap_uri_path, uint8_t* _pu8Resp, uint16_t _u16RespSize)
+{
+    return coap_get_etag(_coap_uri_path, NULL, 0, _pu8Resp, _u16RespSize);
+}
+
+// GET that revalidates a stored response, the server answers 2.03 Valid without payload when _pu8ETag still matches
+int coap_get_etag(const char* _coap_uri_path, const uint8_t* _pu8ETag, uint8_t _u8ETagLen, uint8_t* _pu8Resp, uint16_t _u16RespSize)
+{
+    int iTrans;
 
     // See ns_coap_header.h
     sn_coap_hdr_s *coap_res_ptr = (sn_coap_hdr_s*)calloc(sizeof(sn_coap_hdr_s), 1);
+    if(coap_res_ptr == NULL) {
+        return -1;
+    }
     coap_res_ptr->uri_path_ptr = (uint8_t*)_coap_uri_path;      // Path
     coap_res_ptr->uri_path_len = strlen(_coap_uri_path);   
     coap_res_ptr->msg_code = COAP_MSG_CODE_REQUEST_GET;         // CoAP method
@@ -269,33 +921,142 @@ int8_t coap_get(const char* _coap_uri_path)
     coap_res_ptr->payload_ptr = 0;                                 // Body pointer
     coap_res_ptr->content_format = COAP_CT_TEXT_PLAIN;          // CoAP content type
     coap_res_ptr->options_list_ptr = 0;                         // Optional: options list
-    // Message ID is used to track request->response patterns, because we're using UDP (so everything is unconfirmed).
-    // See the receive code to verify that we get the same message ID back
-    coap_res_ptr->msg_id = 9;
+    if(_u8ETagLen > 0) {
+        // Allocated with the defaults, so only the ETag option is built
+        if(sn_coap_parser_alloc_options(coapHandle, coap_res_ptr) == NULL) {
+            free(coap_res_ptr);
+            return -1;
+        }
+        coap_res_ptr->options_list_ptr->etag_ptr = (uint8_t*)_pu8ETag;
+        coap_res_ptr->options_list_ptr->etag_len = _u8ETagLen;
+    }
 
-    // Calculate the CoAP message size, allocate the memory and build the message
-    message_len = sn_coap_builder_calc_needed_packet_data_size(coap_res_ptr);
-    print_function("Calculated message length: %d bytes\n\r", message_len);
-    message_ptr = (uint8_t*)malloc(message_len);
+    iTrans = coap_send_request(coap_res_ptr, _pu8Resp, _u16RespSize, COAP_PATH_UDP, 0);
+    coap_free(coap_res_ptr->options_list_ptr);
+    free(coap_res_ptr);
 
-#if COAP_API_RAW_DEBUG
-    // Uncomment to see the raw buffer that will be sent...
-    print_function("Message is: ");
-    for (size_t ix = 0; ix < message_len; ix++) {
-         print_function("%02x ", message_ptr[ix]);
+    return iTrans;
+}
+
+// Send an empty confirmable message, the reset answers it, see RFC 7252 4.3.
+// Returns the transaction to pass to coap_ping_check, or -1.
+int coap_ping_send(const SocketAddress &_tAddr)
+{
+    uint8_t aPing[4];
+    int iTrans;
+
+    iTrans = coap_trans_alloc(NULL, 0);
+    if(iTrans < 0) {
+        return -1;
     }
-     print_function("\n\r");
-#endif // COAP_API_RAW_DEBUG
 
-    sn_coap_builder(message_ptr, coap_res_ptr);
-    scount = socket.sendto(SERVER_IP_ADDR, UDP_SOCKET_PORT, message_ptr, message_len);
-#if COAP_API_DEBUG
-    print_function("Sent %d bytes to coap server\n\r", scount);
-#endif // COAP_API_DEBUG
+    aPing[0] = COAP_VERSION_1 | COAP_MSG_TYPE_CONFIRMABLE;
+    aPing[1] = COAP_MSG_CODE_EMPTY;
+    aPing[2] = (uint8_t)(g_tTrans[iTrans].u16MsgId >> 8);
+    aPing[3] = (uint8_t)(g_tTrans[iTrans].u16MsgId & 0xFF);
 
-    free(coap_res_ptr);
-    free(message_ptr);
+    g_tTrans[iTrans].u64SentMs = Kernel::get_ms_count();
+    if(g_ptTransport->pfnSendTo(_tAddr, aPing, sizeof(aPing)) < 0) {
+        coap_trans_free(iTrans);
+        return -1;
+    }
+    return iTrans;
+}
 
-    return 0;
+// Does not wait. Returns 1 while the ping is unanswered, 0 with the round trip once the reset came;
+// the transaction is released then. Give up on an unanswered ping with coap_cancel.
+int coap_ping_check(int _iTrans, uint32_t *_pu32RttMs)
+{
+    int iRet = 1;
+
+    if(_iTrans < 0 || _iTrans >= COAP_TRANSACTION_NUM) {
+        return -1;
+    }
+
+    // The reset carries our message ID, anything else was dropped by coap_handle_datagram
+    g_tRecvMutex.lock();
+    if(g_tTrans[_iTrans].u8State != COAP_TRANS_PENDING) {
+        iRet = (g_tTrans[_iTrans].u8State == COAP_TRANS_DONE) ? 0 : -1;
+        if(_pu32RttMs != NULL) {
+            *_pu32RttMs = g_tTrans[_iTrans].u32RttMs;
+        }
+        coap_trans_release(&g_tTrans[_iTrans]);
+    }
+    g_tRecvMutex.unlock();
+
+    return iRet;
 }
 
+// Requests, bytes and goodput of each transport since coap_init
+void coap_path_report(void)
+{
+    static const char *strPathName[COAP_PATH_NUM] = { "udp", "tcp" };
+    uint32_t u32ElapsedMs = (uint32_t)(Kernel::get_ms_count() - g_u64InitMs);
+    TCoapPathStats tStats[COAP_PATH_NUM];
+    int i;
+
+    g_tRecvMutex.lock();
+    memcpy(tStats, g_tPathStats, sizeof(tStats));
+    g_tRecvMutex.unlock();
+
+    for(i = 0; i < COAP_PATH_NUM; i++) {
+        if(tStats[i].uiReqCnt == 0) {
+            continue;
+        }
+        print_function("%-4s req:%u ok:%u fail:%u tx:%lu B payload:%lu B overhead:%.1f%% avg:%lu ms goodput:%.1f B/s\n",
+                    strPathName[i],
+                    tStats[i].uiReqCnt,
+                    tStats[i].uiOkCnt,
+                    tStats[i].uiFailCnt,
+                    (unsigned long)tStats[i].u64TxBytes,
+                    (unsigned long)tStats[i].u64PayloadBytes,
+                    tStats[i].u64PayloadBytes ? 100.0f * (tStats[i].u64TxBytes - tStats[i].u64PayloadBytes) / tStats[i].u64PayloadBytes : 0.0f,
+                    (unsigned long)(tStats[i].uiOkCnt ? tStats[i].u64ExchangeMs / tStats[i].uiOkCnt : 0),
+                    u32ElapsedMs ? tStats[i].u64PayloadBytes * 1000.0f / u32ElapsedMs : 0.0f);
+    }
+#if COAP_TCP_BULK
+    if(g_ptBulkTransport != NULL) {
+        print_function("tcp  connections:%u\n", coap_tcp_get_connect_cnt());
+    }
+#endif // COAP_TCP_BULK
+}
+
+//
+// Heap and thread stacks as the RTOS counts them, to compare builds such as
+// COAP_EVENT_LOOP on and off. Needs MBED_HEAP_STATS_ENABLED and
+// MBED_STACK_STATS_ENABLED; thread stacks come from the heap, so both count.
+//
+void coap_mem_report(void)
+{
+#if MBED_HEAP_STATS_ENABLED
+    mbed_stats_heap_t tHeap;
+
+    mbed_stats_heap_get(&tHeap);
+    print_function("heap     current:%lu max:%lu reserved:%lu allocs:%lu failed:%lu\n",
+                (unsigned long)tHeap.current_size,
+                (unsigned long)tHeap.max_size,
+                (unsigned long)tHeap.reserved_size,
+                (unsigned long)tHeap.alloc_cnt,
+                (unsigned long)tHeap.alloc_fail_cnt);
+#endif // MBED_HEAP_STATS_ENABLED
+#if MBED_STACK_STATS_ENABLED
+    mbed_stats_stack_t *ptStack;
+    unsigned long ulReserved = 0, ulUsed = 0;
+    size_t tNum, i;
+
+    tNum = osThreadGetCount();
+    ptStack = (mbed_stats_stack_t *)malloc(tNum * sizeof(mbed_stats_stack_t));
+    if(ptStack != NULL) {
+        tNum = mbed_stats_stack_get_each(ptStack, tNum);
+        for(i = 0; i < tNum; i++) {
+            ulReserved += ptStack[i].reserved_size;
+            ulUsed += ptStack[i].max_size;
+        }
+        free(ptStack);
+        print_function("stacks   threads:%u reserved:%lu used:%lu\n", (unsigned int)tNum, ulReserved, ulUsed);
+    }
+#endif // MBED_STACK_STATS_ENABLED
+#if !MBED_HEAP_STATS_ENABLED && !MBED_STACK_STATS_ENABLED
+    print_function("Memory stats off, set MBED_HEAP_STATS_ENABLED and MBED_STACK_STATS_ENABLED\n");
+#endif
+}
@@ -5,17 +5,84 @@
 #include <sn_coap_protocol.h>
 #include <sn_coap_header.h>
 
+#define COAP_TRANSACTION_NUM    8
+#define COAP_ETAG_MAX_LEN       8
+#define COAP_MAX_AGE_DEFAULT    60      // Seconds, when a response carries no Max-Age
+#define COAP_UDP_MAX_MSG_SIZE   1280    // Largest datagram we send or take, the IPv6 minimum MTU
+
+// Returned instead of a transaction when the request does not fit a datagram
+#define COAP_ERR_TOO_LARGE      -2
+
+#define COAP_TRANS_FREE         0
+#define COAP_TRANS_PENDING      1
+#define COAP_TRANS_DONE         2
+#define COAP_TRANS_FAILED       3       // No answer after COAP_MAX_RETRANSMIT
+
+#define COAP_MAX_RETRANSMIT     4
+#define COAP_NSTART_WAIT_MS     30000   // Longest a request waits for a free NSTART slot
+#define COAP_NSTART_RESERVED    1       // Extra slots only alarms may take, see coap_post_alarm
+
+// Bulk uploads over CoAP-over-TCP, see coap_post_bulk
+#ifndef COAP_TCP_BULK
+#define COAP_TCP_BULK           0
+#endif
+#define COAP_TCP_THREAD_STACK_SIZE 2048
+
+#define COAP_PATH_UDP           0
+#define COAP_PATH_TCP           1
+#define COAP_PATH_NUM           2
+
+typedef struct _TCoapTransaction {
+    uint8_t u8State;
+    uint16_t u16MsgId;
+    uint16_t u16MsgCode;
+    uint16_t u16PayloadLen;     // Length in the response, may exceed u16PayloadSize
+    uint16_t u16PayloadSize;
+    uint8_t* pu8Payload;
+    uint64_t u64SentMs;
+    uint32_t u32RttMs;
+    uint32_t u32MaxAge;         // Seconds the response stays fresh
+    uint8_t u8ETagLen;
+    uint8_t u8ETag[COAP_ETAG_MAX_LEN];
+    int8_t i8Endpoint;          // Endpoint the request went to, -1 for pings
+    uint8_t u8Acked;            // Empty ACK came, the response follows separately
+    uint8_t u8RtxCnt;
+    uint8_t u8BackoffX2;        // Variable backoff factor, times two
+    uint32_t u32TimeoutMs;      // Current retransmission timeout
+    int iRtxEvent;
+    uint8_t *pu8Msg;            // Kept for retransmissions
+    uint16_t u16MsgLen;
+    uint8_t u8Path;             // COAP_PATH_UDP or COAP_PATH_TCP
+    uint16_t u16ReqPayloadLen;
+} TCoapTransaction;
+
+// Per transport counters, to compare UDP against TCP for the same upload
+typedef struct _TCoapPathStats {
+    unsigned int uiReqCnt;
+    unsigned int uiOkCnt;
+    unsigned int uiFailCnt;
+    uint64_t u64TxBytes;        // CoAP messages sent, retransmissions included
+    uint64_t u64PayloadBytes;   // Request payloads that got an answer
+    uint64_t u64ExchangeMs;     // Send to answer, summed over the answered requests
+} TCoapPathStats;
+
 int8_t coap_init(uint8_t* _u8RecvBuf);
 void* coap_malloc(uint16_t size);
 void coap_free(void* addr);
 uint8_t coap_tx_cb(uint8_t *a, uint16_t b, sn_nsdl_addr_s *c, void *d);
 int8_t coap_rx_cb(sn_coap_hdr_s *a, sn_nsdl_addr_s *b, void *c);
-int8_t coap_post(const char* _coap_uri_path, const char* _coap_payload);
-int8_t coap_get(const char* _coap_uri_path);
-sn_coap_hdr_s* coap_get_parser_obj(uint8_t *_pu8RecvBuf, uint16_t _u16Len);
-void coap_get_recvcnt(uint16_t *_pu16Len, unsigned int *_puiCnt);
-void coap_inc_recvcnt(void);
-void coap_dec_recvcnt(void);
+int coap_post(const char* _coap_uri_path, const char* _coap_payload, uint8_t* _pu8Resp, uint16_t _u16RespSize);
+int coap_post_bulk(const char* _coap_uri_path, const char* _coap_payload, uint8_t* _pu8Resp, uint16_t _u16RespSize);
+int coap_post_alarm(const char* _coap_uri_path, const char* _coap_payload, uint8_t* _pu8Resp, uint16_t _u16RespSize);
+int coap_get(const char* _coap_uri_path, uint8_t* _pu8Resp, uint16_t _u16RespSize);
+int coap_get_etag(const char* _coap_uri_path, const uint8_t* _pu8ETag, uint8_t _u8ETagLen, uint8_t* _pu8Resp, uint16_t _u16RespSize);
+int coap_wait_response(int _iTrans, uint32_t _u32TimeoutMs, TCoapTransaction *_ptResult);
+void coap_cancel(int _iTrans);
+int coap_ping_send(const SocketAddress &_tAddr);
+int coap_ping_check(int _iTrans, uint32_t *_pu32RttMs);
+int coap_bulk_over_tcp(void);
+void coap_path_report(void);
+void coap_mem_report(void);
 void print_function(const char *format, ...);
 
 #endif // End of __COAP_API_H__
@@ -0,0 +1,520 @@
+
+#include "mbed.h"
+#include "coap_api.h"
+#include "coap_endpoint.h"
+#include "debug_print.h"
+
+#ifndef SERVER_ENDPOINTS
+#define SERVER_ENDPOINTS SERVER_IP_ADDR
+#endif
+
+static NetworkInterface *g_ptEpIface = NULL;
+static TCoapEndpoint g_tEndpoints[ENDPOINT_MAX_NUM];
+static int g_iEpNum = 0;
+static int g_iEpCurrent = -1;
+static uint64_t g_u64EpLastProbeMs = 0;
+static int g_iEpProbing = 0;                // A probe round runs, see coap_endpoint_tick
+static Thread *g_ptEpResolveThread = NULL;  // Only when an endpoint is given by name
+// Requests may come from several threads, the mutex is recursive
+static Mutex g_tEpMutex;
+
+// Probe round in progress, only touched by whoever runs it
+static SocketAddress g_tProbeAddr[ENDPOINT_MAX_NUM];
+static int g_iProbeTrans[ENDPOINT_MAX_NUM];         // Ping in flight, -1 when none
+static uint32_t g_u32ProbeRttMs[ENDPOINT_MAX_NUM];  // ENDPOINT_RTT_UNKNOWN when not answered
+static uint64_t g_u64ProbeEndMs = 0;
+
+static void coap_endpoint_parse(const char *_strList)
+{
+    const char *pcItem = _strList;
+    const char *pcEnd, *pcColon;
+    TCoapEndpoint *ptEp;
+    size_t tLen;
+
+    g_iEpNum = 0;
+    while(*pcItem != '\0' && g_iEpNum < ENDPOINT_MAX_NUM) {
+        while(*pcItem == ' ' || *pcItem == ',') {
+            pcItem++;
+        }
+        if(*pcItem == '\0') {
+            break;
+        }
+        pcEnd = strchr(pcItem, ',');
+        if(pcEnd == NULL) {
+            pcEnd = pcItem + strlen(pcItem);
+        }
+
+        ptEp = &g_tEndpoints[g_iEpNum];
+        memset(ptEp->strHost, 0, ENDPOINT_HOST_LEN);
+        ptEp->u16Port = UDP_SOCKET_PORT;
+        pcColon = (const char *)memchr(pcItem, ':', pcEnd - pcItem);
+        tLen = ((pcColon != NULL) ? pcColon : pcEnd) - pcItem;
+        if(pcColon != NULL) {
+            ptEp->u16Port = (uint16_t)atoi(pcColon + 1);
+        }
+        if(tLen == 0 || tLen >= ENDPOINT_HOST_LEN) {
+            print_function("Endpoint entry ignored, bad host length: %d\n", (int)tLen);
+            pcItem = pcEnd;
+            continue;
+        }
+        strncpy(ptEp->strHost, pcItem, tLen);
+        ptEp->iResolved = 0;
+        ptEp->iHealthy = 0;
+        ptEp->u32RttMs = ENDPOINT_RTT_UNKNOWN;
+        ptEp->uiFailCnt = 0;
+        ptEp->u32SrttStrong = 0;
+        ptEp->u32RttvarStrong = 0;
+        ptEp->u32SrttWeak = 0;
+        ptEp->u32RttvarWeak = 0;
+        ptEp->u32RtoMs = ENDPOINT_RTO_INIT_MS;
+        ptEp->u64RtoUpdatedMs = 0;
+        ptEp->uiNstart = 1;
+        ptEp->uiCleanCnt = 0;
+        g_iEpNum++;
+        pcItem = pcEnd;
+    }
+}
+
+// Host and port are fixed after coap_endpoint_parse, so no lock is needed to read them
+static int coap_endpoint_resolve(const TCoapEndpoint *_ptEp, SocketAddress *_ptAddr)
+{
+    nsapi_error_t err;
+
+    // IP literals need no name server
+    if(_ptAddr->set_ip_address(_ptEp->strHost)) {
+        _ptAddr->set_port(_ptEp->u16Port);
+        return 0;
+    }
+#if COAP_TRANSPORT_REPLAY
+    // No network to ask, and the replayer does not look at addresses
+    _ptAddr->set_ip_address("0.0.0.0");
+    _ptAddr->set_port(_ptEp->u16Port);
+    return 0;
+#endif // COAP_TRANSPORT_REPLAY
+    if(g_ptEpIface == NULL) {
+        return -1;
+    }
+
+    err = g_ptEpIface->gethostbyname(_ptEp->strHost, _ptAddr);
+    if(err != NSAPI_ERROR_OK) {
+        print_function("Resolve %s failed: %d\n", _ptEp->strHost, err);
+        return -1;
+    }
+    _ptAddr->set_port(_ptEp->u16Port);
+    return 0;
+}
+
+static void coap_endpoint_add_rtt(TCoapEndpoint *_ptEp, uint32_t _u32RttMs)
+{
+    if(_ptEp->u32RttMs == ENDPOINT_RTT_UNKNOWN) {
+        _ptEp->u32RttMs = _u32RttMs;
+    }
+    else {
+        _ptEp->u32RttMs = (_ptEp->u32RttMs * 7 + _u32RttMs) / 8;
+    }
+}
+
+// RFC 6298 style smoothing, returns SRTT + K * RTTVAR
+static uint32_t coap_endpoint_estimate(uint32_t *_pu32Srtt, uint32_t *_pu32Rttvar, uint32_t _u32RttMs, uint32_t _u32K)
+{
+    uint32_t u32Delta;
+
+    if(*_pu32Srtt == 0) {
+        *_pu32Srtt = _u32RttMs ? _u32RttMs : 1;
+        *_pu32Rttvar = _u32RttMs / 2;
+    }
+    else {
+        u32Delta = (*_pu32Srtt > _u32RttMs) ? *_pu32Srtt - _u32RttMs : _u32RttMs - *_pu32Srtt;
+        *_pu32Rttvar = (*_pu32Rttvar * 3 + u32Delta) / 4;
+        *_pu32Srtt = (*_pu32Srtt * 7 + _u32RttMs) / 8;
+    }
+    return *_pu32Srtt + _u32K * *_pu32Rttvar;
+}
+
+// Strong samples weigh 1/2 in the overall RTO, weak ones 1/4
+static void coap_endpoint_add_sample(TCoapEndpoint *_ptEp, uint32_t _u32RttMs, unsigned int _uiRtxCnt)
+{
+    uint32_t u32RtoMs;
+
+    if(_uiRtxCnt == 0) {
+        u32RtoMs = coap_endpoint_estimate(&_ptEp->u32SrttStrong, &_ptEp->u32RttvarStrong, _u32RttMs, ENDPOINT_STRONG_K);
+        _ptEp->u32RtoMs = (_ptEp->u32RtoMs + u32RtoMs) / 2;
+    }
+    else if(_uiRtxCnt <= 2) {
+        u32RtoMs = coap_endpoint_estimate(&_ptEp->u32SrttWeak, &_ptEp->u32RttvarWeak, _u32RttMs, ENDPOINT_WEAK_K);
+        _ptEp->u32RtoMs = (_ptEp->u32RtoMs * 3 + u32RtoMs) / 4;
+    }
+    else {
+        // Cannot tell which transmission was answered
+        return;
+    }
+
+    if(_ptEp->u32RtoMs > ENDPOINT_RTO_MAX_MS) {
+        _ptEp->u32RtoMs = ENDPOINT_RTO_MAX_MS;
+    }
+    _ptEp->u64RtoUpdatedMs = Kernel::get_ms_count();
+}
+
+// Pick the healthy endpoint with the lowest RTT
+static void coap_endpoint_select(void)
+{
+    int i, iBest = -1;
+
+    for(i = 0; i < g_iEpNum; i++) {
+        if(!g_tEndpoints[i].iResolved || !g_tEndpoints[i].iHealthy) {
+            continue;
+        }
+        if(iBest < 0 || g_tEndpoints[i].u32RttMs < g_tEndpoints[iBest].u32RttMs) {
+            iBest = i;
+        }
+    }
+
+    // Nothing answers, keep sending to the first one we could resolve
+    if(iBest < 0) {
+        for(i = 0; i < g_iEpNum; i++) {
+            if(g_tEndpoints[i].iResolved) {
+                iBest = i;
+                break;
+            }
+        }
+    }
+
+    if(iBest != g_iEpCurrent && iBest >= 0) {
+        print_function("Use endpoint %s:%d\n", g_tEndpoints[iBest].strHost, g_tEndpoints[iBest].u16Port);
+    }
+    g_iEpCurrent = iBest;
+}
+
+//
+// Look up every endpoint without g_tEpMutex and publish the addresses under
+// it. A failed lookup keeps the old address. Names are looked up only here,
+// at start-up and then in the resolver thread, never on the event queue: a
+// slow name server would stall every event on it for the whole DNS timeout.
+//
+static void coap_endpoint_resolve_all(void)
+{
+    SocketAddress tAddr;
+    int i;
+
+    for(i = 0; i < g_iEpNum; i++) {
+        if(coap_endpoint_resolve(&g_tEndpoints[i], &tAddr) != 0) {
+            continue;
+        }
+        g_tEpMutex.lock();
+        g_tEndpoints[i].tAddr = tAddr;
+        g_tEndpoints[i].iResolved = 1;
+        g_tEpMutex.unlock();
+    }
+}
+
+// Names may move, look them up again every ENDPOINT_PROBE_SEC
+static void coap_endpoint_resolve_main(void)
+{
+    while(1) {
+        ThisThread::sleep_for(ENDPOINT_PROBE_SEC * 1000);
+        coap_endpoint_resolve_all();
+    }
+}
+
+//
+// A probe round pings all resolved endpoints at once, then collects the
+// answers. Pings run without g_tEpMutex, so requests in other threads are not
+// held up; it is only taken to read the addresses and to publish the results.
+//
+static void coap_endpoint_probe_begin(void)
+{
+    int i, iResolved;
+
+    for(i = 0; i < g_iEpNum; i++) {
+        g_tEpMutex.lock();
+        iResolved = g_tEndpoints[i].iResolved;
+        g_tProbeAddr[i] = g_tEndpoints[i].tAddr;
+        g_tEpMutex.unlock();
+
+        g_u32ProbeRttMs[i] = ENDPOINT_RTT_UNKNOWN;
+        g_iProbeTrans[i] = iResolved ? coap_ping_send(g_tProbeAddr[i]) : -1;
+    }
+    g_u64ProbeEndMs = Kernel::get_ms_count() + ENDPOINT_PROBE_TIMEOUT_MS;
+}
+
+// Collect the answers so far, returns 1 once the round is over and published
+static int coap_endpoint_probe_step(int _iFinish)
+{
+    TCoapEndpoint *ptEp;
+    int i, iWaiting = 0;
+
+    if(Kernel::get_ms_count() >= g_u64ProbeEndMs) {
+        _iFinish = 1;
+    }
+
+    for(i = 0; i < g_iEpNum; i++) {
+        if(g_iProbeTrans[i] < 0) {
+            continue;
+        }
+        if(coap_ping_check(g_iProbeTrans[i], &g_u32ProbeRttMs[i]) > 0) {
+            if(!_iFinish) {
+                iWaiting = 1;
+                continue;
+            }
+#if COAP_API_DEBUG
+            print_function("Ping %s timeout\n", g_tProbeAddr[i].get_ip_address());
+#endif // COAP_API_DEBUG
+            coap_cancel(g_iProbeTrans[i]);
+        }
+        g_iProbeTrans[i] = -1;
+    }
+    if(iWaiting) {
+        return 0;
+    }
+
+    g_tEpMutex.lock();
+    for(i = 0; i < g_iEpNum; i++) {
+        ptEp = &g_tEndpoints[i];
+        if(g_u32ProbeRttMs[i] != ENDPOINT_RTT_UNKNOWN) {
+            coap_endpoint_add_rtt(ptEp, g_u32ProbeRttMs[i]);
+            coap_endpoint_add_sample(ptEp, g_u32ProbeRttMs[i], 0);
+            ptEp->iHealthy = 1;
+            ptEp->uiFailCnt = 0;
+        }
+        else {
+            ptEp->iHealthy = 0;
+        }
+    }
+
+    g_u64EpLastProbeMs = Kernel::get_ms_count();
+    g_iEpProbing = 0;
+    coap_endpoint_select();
+#if COAP_API_DEBUG
+    coap_endpoint_report();
+#endif // COAP_API_DEBUG
+    g_tEpMutex.unlock();
+    return 1;
+}
+
+static void coap_endpoint_poll_event(void)
+{
+    if(coap_endpoint_probe_step(0)) {
+        return;
+    }
+    // Queue full, take what came so far rather than leave the round open
+    if(mbed_event_queue()->call_in(ENDPOINT_PROBE_POLL_MS, coap_endpoint_poll_event) == 0) {
+        coap_endpoint_probe_step(1);
+    }
+}
+
+// Runs on the shared event queue, only sends pings and polls for the answers
+static void coap_endpoint_probe_event(void)
+{
+    coap_endpoint_probe_begin();
+    coap_endpoint_poll_event();
+}
+
+// Probe round in the calling thread, for start-up
+void coap_endpoint_probe(void)
+{
+    g_tEpMutex.lock();
+    if(g_iEpProbing) {
+        g_tEpMutex.unlock();
+        return;
+    }
+    g_iEpProbing = 1;
+    g_tEpMutex.unlock();
+
+    coap_endpoint_probe_begin();
+    while(!coap_endpoint_probe_step(0)) {
+        ThisThread::sleep_for(ENDPOINT_PROBE_POLL_MS);
+    }
+}
+
+int coap_endpoint_init(NetworkInterface *_ptIface)
+{
+    SocketAddress tAddr;
+    int i;
+
+    g_ptEpIface = _ptIface;
+    g_iEpCurrent = -1;
+    coap_endpoint_parse(SERVER_ENDPOINTS);
+    if(g_iEpNum == 0) {
+        print_function("No server endpoint configured!\n");
+        return -1;
+    }
+
+    coap_endpoint_resolve_all();
+    // IP literals never change, a thread is only needed to follow names
+    for(i = 0; i < g_iEpNum && g_ptEpIface != NULL && g_ptEpResolveThread == NULL; i++) {
+        if(!tAddr.set_ip_address(g_tEndpoints[i].strHost)) {
+            g_ptEpResolveThread = new Thread(osPriorityBelowNormal, ENDPOINT_RESOLVE_STACK_SIZE);
+            g_ptEpResolveThread->start(coap_endpoint_resolve_main);
+        }
+    }
+
+    coap_endpoint_probe();
+    if(g_iEpCurrent < 0) {
+        print_function("No server endpoint could be resolved!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Call between requests, starts a probe round on the shared event queue every ENDPOINT_PROBE_SEC.
+// Does not wait for it, requests keep going to the current endpoint meanwhile.
+void coap_endpoint_tick(void)
+{
+    int iStart = 0;
+
+    g_tEpMutex.lock();
+    if(!g_iEpProbing && Kernel::get_ms_count() - g_u64EpLastProbeMs >= ENDPOINT_PROBE_SEC * 1000ULL) {
+        g_iEpProbing = 1;
+        iStart = 1;
+    }
+    g_tEpMutex.unlock();
+
+    if(iStart && mbed_event_queue()->call(coap_endpoint_probe_event) == 0) {
+        // Queue full, the next request tries again
+        g_tEpMutex.lock();
+        g_iEpProbing = 0;
+        g_tEpMutex.unlock();
+    }
+}
+
+// Address of the endpoint requests go to, returns its index or -1
+int coap_endpoint_current(SocketAddress *_ptAddr)
+{
+    int iRet = -1;
+
+    g_tEpMutex.lock();
+    if(g_iEpCurrent >= 0) {
+        *_ptAddr = g_tEndpoints[g_iEpCurrent].tAddr;
+        iRet = g_iEpCurrent;
+    }
+    g_tEpMutex.unlock();
+    return iRet;
+}
+
+// Address of an endpoint picked by coap_endpoint_current, for retransmissions
+int coap_endpoint_addr(int _iEp, SocketAddress *_ptAddr)
+{
+    int iRet = -1;
+
+    g_tEpMutex.lock();
+    if(_iEp >= 0 && _iEp < g_iEpNum && g_tEndpoints[_iEp].iResolved) {
+        *_ptAddr = g_tEndpoints[_iEp].tAddr;
+        iRet = 0;
+    }
+    g_tEpMutex.unlock();
+    return iRet;
+}
+
+// Overall RTO, aged when no samples came for a while
+uint32_t coap_endpoint_rto(int _iEp)
+{
+    TCoapEndpoint *ptEp;
+    uint64_t u64NowMs = Kernel::get_ms_count();
+    uint32_t u32RtoMs = ENDPOINT_RTO_INIT_MS;
+
+    g_tEpMutex.lock();
+    if(_iEp >= 0 && _iEp < g_iEpNum) {
+        ptEp = &g_tEndpoints[_iEp];
+        if(ptEp->u32RtoMs < 1000 && u64NowMs - ptEp->u64RtoUpdatedMs > 16ULL * ptEp->u32RtoMs) {
+            ptEp->u32RtoMs *= 2;
+            ptEp->u64RtoUpdatedMs = u64NowMs;
+        }
+        else if(ptEp->u32RtoMs > 3000 && u64NowMs - ptEp->u64RtoUpdatedMs > 4ULL * ptEp->u32RtoMs) {
+            ptEp->u32RtoMs = (ptEp->u32RtoMs + ENDPOINT_RTO_INIT_MS) / 2;
+            ptEp->u64RtoUpdatedMs = u64NowMs;
+        }
+        u32RtoMs = ptEp->u32RtoMs;
+    }
+    g_tEpMutex.unlock();
+    return u32RtoMs;
+}
+
+unsigned int coap_endpoint_nstart(int _iEp)
+{
+    unsigned int uiNstart = 1;
+
+    g_tEpMutex.lock();
+    if(_iEp >= 0 && _iEp < g_iEpNum) {
+        uiNstart = g_tEndpoints[_iEp].uiNstart;
+    }
+    g_tEpMutex.unlock();
+    return uiNstart;
+}
+
+// Round trip from the first transmission of a request sent to _iEp
+void coap_endpoint_on_response(int _iEp, uint32_t _u32RttMs, unsigned int _uiRtxCnt)
+{
+    TCoapEndpoint *ptEp;
+
+    g_tEpMutex.lock();
+    if(_iEp < 0 || _iEp >= g_iEpNum) {
+        g_tEpMutex.unlock();
+        return;
+    }
+    ptEp = &g_tEndpoints[_iEp];
+    if(_uiRtxCnt == 0) {
+        coap_endpoint_add_rtt(ptEp, _u32RttMs);
+    }
+    coap_endpoint_add_sample(ptEp, _u32RttMs, _uiRtxCnt);
+    ptEp->uiFailCnt = 0;
+    ptEp->iHealthy = 1;
+
+    if(_uiRtxCnt > 0) {
+        ptEp->uiNstart = (ptEp->uiNstart > 1) ? ptEp->uiNstart / 2 : 1;
+        ptEp->uiCleanCnt = 0;
+    }
+    else if(++ptEp->uiCleanCnt >= ENDPOINT_NSTART_GROW_CNT) {
+        if(ptEp->uiNstart < ENDPOINT_NSTART_MAX) {
+            ptEp->uiNstart++;
+        }
+        ptEp->uiCleanCnt = 0;
+    }
+    g_tEpMutex.unlock();
+}
+
+void coap_endpoint_on_timeout(int _iEp)
+{
+    TCoapEndpoint *ptEp;
+
+    g_tEpMutex.lock();
+    if(_iEp < 0 || _iEp >= g_iEpNum) {
+        g_tEpMutex.unlock();
+        return;
+    }
+    ptEp = &g_tEndpoints[_iEp];
+    ptEp->uiNstart = 1;
+    ptEp->uiCleanCnt = 0;
+    ptEp->uiFailCnt++;
+    if(ptEp->uiFailCnt >= ENDPOINT_FAIL_THRESHOLD && _iEp == g_iEpCurrent) {
+        print_function("Endpoint %s:%d failed %d times, fail over\n", ptEp->strHost, ptEp->u16Port, ptEp->uiFailCnt);
+        ptEp->iHealthy = 0;
+        coap_endpoint_select();
+        if(!g_tEndpoints[g_iEpCurrent].iHealthy) {
+            // All of them are down, probe again at the next request
+            g_u64EpLastProbeMs = 0;
+        }
+    }
+    g_tEpMutex.unlock();
+}
+
+void coap_endpoint_report(void)
+{
+    TCoapEndpoint *ptEp;
+    int i;
+
+    g_tEpMutex.lock();
+    for(i = 0; i < g_iEpNum; i++) {
+        ptEp = &g_tEndpoints[i];
+        print_function("%c %s:%d %s rtt:%ld rto:%lu nstart:%u fail:%d\n",
+                    (i == g_iEpCurrent) ? '*' : ' ',
+                    ptEp->strHost,
+                    ptEp->u16Port,
+                    ptEp->iHealthy ? "up" : "down",
+                    (ptEp->u32RttMs == ENDPOINT_RTT_UNKNOWN) ? -1L : (long)ptEp->u32RttMs,
+                    (unsigned long)ptEp->u32RtoMs,
+                    ptEp->uiNstart,
+                    ptEp->uiFailCnt);
+    }
+    g_tEpMutex.unlock();
+}
@@ -0,0 +1,66 @@
+#ifndef __COAP_ENDPOINT_H__
+#define __COAP_ENDPOINT_H__
+
+#include <mbed.h>
+
+//
+// Cloud endpoints come from SERVER_ENDPOINTS, a comma separated list of
+// "host[:port]" where host is a name or an IPv4 address, e.g.
+//   "SERVER_ENDPOINTS=\"iot.cht.com.tw,211.20.181.199:5683\""
+// Without it the single SERVER_IP_ADDR is used.
+//
+#define ENDPOINT_MAX_NUM            4
+#define ENDPOINT_HOST_LEN           64
+#define ENDPOINT_PROBE_SEC          300
+#define ENDPOINT_PROBE_TIMEOUT_MS   5000
+#define ENDPOINT_PROBE_POLL_MS      100     // How often a probe round looks for answers
+#define ENDPOINT_RESOLVE_STACK_SIZE 2048    // Name lookups, nsapi_dns keeps its packets on the heap
+#define ENDPOINT_FAIL_THRESHOLD     3
+#define ENDPOINT_RTT_UNKNOWN        0xFFFFFFFF
+
+//
+// Retransmission timeout per endpoint after CoCoA (draft-ietf-core-cocoa):
+// a strong estimator fed by exchanges answered without retransmission and a
+// weak one fed by exchanges that needed one or two, both from the first
+// transmission. Each new estimate is blended into the overall RTO, which
+// ages back towards the initial value while no samples arrive. The number
+// of requests in flight (NSTART) grows by one after a run of clean
+// exchanges and halves on every retransmission or timeout.
+//
+#define ENDPOINT_RTO_INIT_MS        2000
+#define ENDPOINT_RTO_MAX_MS         60000
+#define ENDPOINT_STRONG_K           4
+#define ENDPOINT_WEAK_K             1
+#define ENDPOINT_NSTART_MAX         4
+#define ENDPOINT_NSTART_GROW_CNT    8
+
+typedef struct _TCoapEndpoint {
+    char strHost[ENDPOINT_HOST_LEN];
+    uint16_t u16Port;
+    SocketAddress tAddr;
+    int iResolved;
+    int iHealthy;
+    uint32_t u32RttMs;          // Smoothed round trip time
+    unsigned int uiFailCnt;     // Consecutive timeouts
+    uint32_t u32SrttStrong;     // 0 until the first sample
+    uint32_t u32RttvarStrong;
+    uint32_t u32SrttWeak;
+    uint32_t u32RttvarWeak;
+    uint32_t u32RtoMs;
+    uint64_t u64RtoUpdatedMs;
+    unsigned int uiNstart;
+    unsigned int uiCleanCnt;    // Exchanges without retransmission in a row
+} TCoapEndpoint;
+
+int coap_endpoint_init(NetworkInterface *_ptIface);
+void coap_endpoint_probe(void);
+void coap_endpoint_tick(void);
+int coap_endpoint_current(SocketAddress *_ptAddr);
+int coap_endpoint_addr(int _iEp, SocketAddress *_ptAddr);
+uint32_t coap_endpoint_rto(int _iEp);
+unsigned int coap_endpoint_nstart(int _iEp);
+void coap_endpoint_on_response(int _iEp, uint32_t _u32RttMs, unsigned int _uiRtxCnt);
+void coap_endpoint_on_timeout(int _iEp);
+void coap_endpoint_report(void);
+
+#endif // End of __COAP_ENDPOINT_H__
@@ -0,0 +1,1148 @@
+
+#include "mbed.h"
+#include "UDPSocket.h"
+#include "TCPSocket.h"
+#include "sn_coap_header.h"
+#include "coap_transport.h"
+#include "debug_print.h"
+
+//
+// UDP transport over the cellular interface
+//
+static UDPSocket g_tUdpSocket;
+static bool g_bUdpBlocking = true;
+
+static nsapi_error_t coap_udp_open(NetworkInterface *_ptIface)
+{
+    return g_tUdpSocket.open(_ptIface);
+}
+
+static nsapi_error_t coap_udp_close(void)
+{
+    return g_tUdpSocket.close();
+}
+
+//
+// In event loop mode the socket is non-blocking for receiving, and sends
+// share it. A modem that is busy for a moment answers WOULD_BLOCK, so try
+// again a few times instead of failing the request or losing a retransmission.
+//
+static nsapi_size_or_error_t coap_udp_sendto(const SocketAddress &_tAddr, const void *_pvData, nsapi_size_t _tSize)
+{
+    nsapi_size_or_error_t ret;
+    int i;
+
+    ret = g_tUdpSocket.sendto(_tAddr, _pvData, _tSize);
+    for(i = 0; ret == NSAPI_ERROR_WOULD_BLOCK && !g_bUdpBlocking && i < COAP_UDP_SEND_RETRY_NUM; i++) {
+        ThisThread::sleep_for(COAP_UDP_SEND_RETRY_MS);
+        ret = g_tUdpSocket.sendto(_tAddr, _pvData, _tSize);
+    }
+    return ret;
+}
+
+static nsapi_size_or_error_t coap_udp_recvfrom(SocketAddress *_ptAddr, void *_pvData, nsapi_size_t _tSize)
+{
+    return g_tUdpSocket.recvfrom(_ptAddr, _pvData, _tSize);
+}
+
+static void coap_udp_set_blocking(bool _bBlocking)
+{
+    g_bUdpBlocking = _bBlocking;
+    g_tUdpSocket.set_blocking(_bBlocking);
+}
+
+static void coap_udp_sigio(Callback<void()> _tFunc)
+{
+    g_tUdpSocket.sigio(_tFunc);
+}
+
+static const TCoapTransport g_tUdpTransport = {
+    "udp",
+    coap_udp_open,
+    coap_udp_close,
+    coap_udp_sendto,
+    coap_udp_recvfrom,
+    coap_udp_set_blocking,
+    coap_udp_sigio
+};
+
+const TCoapTransport* coap_transport_udp(void)
+{
+    return &g_tUdpTransport;
+}
+
+//
+// CoAP over TCP (RFC 8323), one persistent connection to the endpoint of the
+// last send, opened on the first send and again after it was lost. Messages
+// are translated to and from the UDP format so the layers above do not
+// change: a request without token gets its message ID as a 2-byte token and
+// the response comes back as an ACK with that message ID. An empty CON goes
+// out as 7.02 Ping and the 7.03 Pong comes back as a reset. Receiving runs in
+// one thread only.
+//
+#define COAP_TCP_CODE_CSM           0xE1
+#define COAP_TCP_CODE_PING          0xE2
+#define COAP_TCP_CODE_PONG          0xE3
+#define COAP_TCP_CODE_RELEASE       0xE4
+#define COAP_TCP_CODE_ABORT         0xE5
+#define COAP_TCP_OPTION_MAX_MSG     2       // Max-Message-Size in a CSM
+
+#define COAP_TCP_FLAG_CONNECTED     0x1
+#define COAP_TCP_FLAG_CSM           0x2     // Peer's CSM received
+
+static TCPSocket g_tTcpSocket;
+static NetworkInterface *g_ptTcpIface = NULL;
+static SocketAddress g_tTcpPeer;
+static bool g_bTcpConnected = false;
+static unsigned int g_uiTcpGen = 0;         // Bumped on every connect and drop
+static unsigned int g_uiTcpConnectCnt = 0;
+static uint32_t g_u32TcpBackoffMs = 0;      // 0 while connects succeed
+static uint64_t g_u64TcpRetryMs = 0;        // No connect attempt before this
+static uint32_t g_u32TcpPeerMaxMsg = COAP_TCP_DEFAULT_MSG_SIZE;
+static Mutex g_tTcpMutex;                   // Socket state and the send side
+static EventFlags g_tTcpFlags;
+static uint8_t g_u8TcpRxBuf[COAP_TCP_MAX_MSG_SIZE];
+static uint32_t g_u32TcpRxLen = 0;
+
+// Call with g_tTcpMutex held
+static void coap_tcp_drop(void)
+{
+    if(!g_bTcpConnected) {
+        return;
+    }
+    g_tTcpSocket.close();
+    g_bTcpConnected = false;
+    g_uiTcpGen++;
+    g_tTcpFlags.clear(COAP_TCP_FLAG_CONNECTED | COAP_TCP_FLAG_CSM);
+}
+
+//
+// Call with g_tTcpMutex held. The socket blocks for up to COAP_TCP_POLL_MS on
+// each try, and a frame may not be cut by another sender, so the lock is
+// kept; COAP_TCP_SEND_TIMEOUT_MS bounds how long that can be.
+//
+static nsapi_error_t coap_tcp_send_all(const void *_pvData, nsapi_size_t _tSize)
+{
+    const uint8_t *pu8Data = (const uint8_t *)_pvData;
+    uint64_t u64EndMs = Kernel::get_ms_count() + COAP_TCP_SEND_TIMEOUT_MS;
+    nsapi_size_or_error_t ret;
+
+    while(_tSize > 0) {
+        ret = g_tTcpSocket.send(pu8Data, _tSize);
+        if(ret == NSAPI_ERROR_WOULD_BLOCK && Kernel::get_ms_count() < u64EndMs) {
+            continue;
+        }
+        if(ret < 0) {
+            print_function("TCP send failed: %d\n", ret);
+            coap_tcp_drop();
+            return ret;
+        }
+        pu8Data += ret;
+        _tSize -= ret;
+    }
+    return NSAPI_ERROR_OK;
+}
+
+// Frame header up to the code, returns its length
+static int coap_tcp_frame_hdr(uint8_t *_pu8Hdr, uint32_t _u32BodyLen, uint8_t _u8Tkl)
+{
+    if(_u32BodyLen < 13) {
+        _pu8Hdr[0] = (uint8_t)(_u32BodyLen << 4) | _u8Tkl;
+        return 1;
+    }
+    if(_u32BodyLen < 269) {
+        _pu8Hdr[0] = (13 << 4) | _u8Tkl;
+        _pu8Hdr[1] = (uint8_t)(_u32BodyLen - 13);
+        return 2;
+    }
+    if(_u32BodyLen < 65805) {
+        _pu8Hdr[0] = (14 << 4) | _u8Tkl;
+        _pu8Hdr[1] = (uint8_t)((_u32BodyLen - 269) >> 8);
+        _pu8Hdr[2] = (uint8_t)(_u32BodyLen - 269);
+        return 3;
+    }
+    _pu8Hdr[0] = (15 << 4) | _u8Tkl;
+    _pu8Hdr[1] = (uint8_t)((_u32BodyLen - 65805) >> 24);
+    _pu8Hdr[2] = (uint8_t)((_u32BodyLen - 65805) >> 16);
+    _pu8Hdr[3] = (uint8_t)((_u32BodyLen - 65805) >> 8);
+    _pu8Hdr[4] = (uint8_t)(_u32BodyLen - 65805);
+    return 5;
+}
+
+// Returns 1 and the lengths once a whole frame is buffered, 0 while more bytes are needed
+static int coap_tcp_frame_len(const uint8_t *_pu8Buf, uint32_t _u32Len, uint32_t *_pu32HdrLen, uint32_t *_pu32BodyLen)
+{
+    uint8_t u8Len;
+    uint32_t u32Ext;
+
+    if(_u32Len < 1) {
+        return 0;
+    }
+    u8Len = _pu8Buf[0] >> 4;
+    u32Ext = (u8Len < 13) ? 0 : ((u8Len == 13) ? 1 : ((u8Len == 14) ? 2 : 4));
+    if(_u32Len < 1 + u32Ext) {
+        return 0;
+    }
+
+    switch(u8Len) {
+    case 13:
+        *_pu32BodyLen = _pu8Buf[1] + 13;
+        break;
+    case 14:
+        *_pu32BodyLen = ((uint32_t)_pu8Buf[1] << 8 | _pu8Buf[2]) + 269;
+        break;
+    case 15:
+        *_pu32BodyLen = ((uint32_t)_pu8Buf[1] << 24 | (uint32_t)_pu8Buf[2] << 16 | (uint32_t)_pu8Buf[3] << 8 | _pu8Buf[4]) + 65805;
+        break;
+    default:
+        *_pu32BodyLen = u8Len;
+        break;
+    }
+    // Code and token
+    *_pu32HdrLen = 1 + u32Ext + 1 + (_pu8Buf[0] & 0x0F);
+
+    return (_u32Len >= *_pu32HdrLen + *_pu32BodyLen) ? 1 : 0;
+}
+
+// Call with g_tTcpMutex held
+static nsapi_error_t coap_tcp_send_frame(uint8_t _u8Code, const uint8_t *_pu8Token, uint8_t _u8Tkl, const uint8_t *_pu8Body, uint32_t _u32BodyLen)
+{
+    uint8_t aHdr[5 + 1 + 8];
+    int iLen;
+    nsapi_error_t err;
+
+    iLen = coap_tcp_frame_hdr(aHdr, _u32BodyLen, _u8Tkl);
+    aHdr[iLen++] = _u8Code;
+    memcpy(&aHdr[iLen], _pu8Token, _u8Tkl);
+    iLen += _u8Tkl;
+
+    err = coap_tcp_send_all(aHdr, iLen);
+    if(err == NSAPI_ERROR_OK && _u32BodyLen > 0) {
+        err = coap_tcp_send_all(_pu8Body, _u32BodyLen);
+    }
+    return err;
+}
+
+// Take Max-Message-Size from the peer's CSM, other options are not used
+static void coap_tcp_parse_csm(const uint8_t *_pu8Opt, uint32_t _u32Len)
+{
+    uint32_t u32Ofs = 0, u32Num = 0, u32Delta, u32OptLen, u32Value, i;
+
+    while(u32Ofs < _u32Len && _pu8Opt[u32Ofs] != 0xFF) {
+        u32Delta = _pu8Opt[u32Ofs] >> 4;
+        u32OptLen = _pu8Opt[u32Ofs] & 0x0F;
+        u32Ofs++;
+        if(u32Delta == 13) {
+            u32Delta = _pu8Opt[u32Ofs++] + 13;
+        }
+        else if(u32Delta == 14) {
+            u32Delta = ((uint32_t)_pu8Opt[u32Ofs] << 8 | _pu8Opt[u32Ofs + 1]) + 269;
+            u32Ofs += 2;
+        }
+        if(u32OptLen == 13) {
+            u32OptLen = _pu8Opt[u32Ofs++] + 13;
+        }
+        else if(u32OptLen == 14) {
+            u32OptLen = ((uint32_t)_pu8Opt[u32Ofs] << 8 | _pu8Opt[u32Ofs + 1]) + 269;
+            u32Ofs += 2;
+        }
+        if(u32Ofs + u32OptLen > _u32Len) {
+            return;
+        }
+
+        u32Num += u32Delta;
+        if(u32Num == COAP_TCP_OPTION_MAX_MSG && u32OptLen <= 4) {
+            u32Value = 0;
+            for(i = 0; i < u32OptLen; i++) {
+                u32Value = u32Value << 8 | _pu8Opt[u32Ofs + i];
+            }
+            g_u32TcpPeerMaxMsg = u32Value;
+        }
+        u32Ofs += u32OptLen;
+    }
+}
+
+// Call with g_tTcpMutex held. The next connect waits twice as long as the last, up to COAP_TCP_BACKOFF_MAX_MS.
+static void coap_tcp_backoff(void)
+{
+    if(g_u32TcpBackoffMs == 0) {
+        g_u32TcpBackoffMs = COAP_TCP_BACKOFF_MS;
+    }
+    else if(g_u32TcpBackoffMs < COAP_TCP_BACKOFF_MAX_MS / 2) {
+        g_u32TcpBackoffMs *= 2;
+    }
+    else {
+        g_u32TcpBackoffMs = COAP_TCP_BACKOFF_MAX_MS;
+    }
+    g_u64TcpRetryMs = Kernel::get_ms_count() + g_u32TcpBackoffMs;
+    print_function("TCP connect again in %lu s\n", (unsigned long)(g_u32TcpBackoffMs / 1000));
+}
+
+//
+// Call with g_tTcpMutex held, reuses the connection when it goes to the same
+// peer. During the back-off after a failed connect it fails at once, so the
+// caller can fall back to UDP instead of waiting on a dead path.
+//
+static nsapi_error_t coap_tcp_connect(const SocketAddress &_tAddr)
+{
+    // Our CSM, Max-Message-Size only
+    static const uint8_t aCsmOpt[] = { (COAP_TCP_OPTION_MAX_MSG << 4) | 2,
+                                       (uint8_t)(COAP_TCP_MAX_MSG_SIZE >> 8),
+                                       (uint8_t)(COAP_TCP_MAX_MSG_SIZE & 0xFF) };
+    nsapi_error_t err;
+
+    if(g_bTcpConnected && g_tTcpPeer == _tAddr) {
+        return NSAPI_ERROR_OK;
+    }
+    // Endpoint changed
+    coap_tcp_drop();
+    if(g_u32TcpBackoffMs != 0 && Kernel::get_ms_count() < g_u64TcpRetryMs) {
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+
+    err = g_tTcpSocket.open(g_ptTcpIface);
+    if(err != NSAPI_ERROR_OK) {
+        coap_tcp_backoff();
+        return err;
+    }
+    g_tTcpSocket.set_timeout(COAP_TCP_CONNECT_TIMEOUT_MS);
+    err = g_tTcpSocket.connect(_tAddr);
+    if(err != NSAPI_ERROR_OK) {
+        print_function("TCP connect to %s failed: %d\n", _tAddr.get_ip_address(), err);
+        g_tTcpSocket.close();
+        coap_tcp_backoff();
+        return err;
+    }
+    // From here on it is the receiver's poll rate, coap_tcp_send_all has its own limit
+    g_tTcpSocket.set_timeout(COAP_TCP_POLL_MS);
+    g_u32TcpBackoffMs = 0;
+
+    g_tTcpPeer = _tAddr;
+    g_u32TcpPeerMaxMsg = COAP_TCP_DEFAULT_MSG_SIZE;
+    g_bTcpConnected = true;
+    g_uiTcpGen++;
+    g_uiTcpConnectCnt++;
+    g_tTcpFlags.set(COAP_TCP_FLAG_CONNECTED);
+
+    err = coap_tcp_send_frame(COAP_TCP_CODE_CSM, NULL, 0, aCsmOpt, sizeof(aCsmOpt));
+    if(err != NSAPI_ERROR_OK) {
+        return err;
+    }
+
+    // The peer's CSM comes first, it may raise the default message size
+    g_tTcpMutex.unlock();
+    g_tTcpFlags.wait_any(COAP_TCP_FLAG_CSM, COAP_TCP_CSM_TIMEOUT_MS, false);
+    g_tTcpMutex.lock();
+    return g_bTcpConnected ? NSAPI_ERROR_OK : NSAPI_ERROR_NO_CONNECTION;
+}
+
+static nsapi_error_t coap_tcp_open(NetworkInterface *_ptIface)
+{
+    g_ptTcpIface = _ptIface;
+    return NSAPI_ERROR_OK;
+}
+
+static nsapi_error_t coap_tcp_close(void)
+{
+    g_tTcpMutex.lock();
+    coap_tcp_drop();
+    g_tTcpMutex.unlock();
+    return NSAPI_ERROR_OK;
+}
+
+static nsapi_size_or_error_t coap_tcp_sendto(const SocketAddress &_tAddr, const void *_pvData, nsapi_size_t _tSize)
+{
+    const uint8_t *pu8Msg = (const uint8_t *)_pvData;
+    const uint8_t *pu8Token;
+    uint8_t u8Tkl, u8Type, u8Code;
+    uint32_t u32BodyLen;
+    nsapi_error_t err;
+
+    if(_tSize < 4 || _tSize < 4U + (pu8Msg[0] & 0x0F)) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+    u8Tkl = pu8Msg[0] & 0x0F;
+    u8Type = pu8Msg[0] & 0x30;
+    u8Code = pu8Msg[1];
+    u32BodyLen = _tSize - 4 - u8Tkl;
+
+    if(u8Code == COAP_MSG_CODE_EMPTY && u8Type != COAP_MSG_TYPE_CONFIRMABLE) {
+        // No ACK or RST on a reliable transport
+        return _tSize;
+    }
+
+    // Without a token the message ID stands in for it
+    pu8Token = (u8Tkl > 0) ? &pu8Msg[4] : &pu8Msg[2];
+    if(u8Tkl == 0) {
+        u8Tkl = 2;
+    }
+
+    g_tTcpMutex.lock();
+    err = coap_tcp_connect(_tAddr);
+    if(err == NSAPI_ERROR_OK && 1 + 4 + 1 + u8Tkl + u32BodyLen > g_u32TcpPeerMaxMsg) {
+        print_function("%u bytes over the peer's Max-Message-Size %lu\n", (unsigned int)_tSize, (unsigned long)g_u32TcpPeerMaxMsg);
+        err = NSAPI_ERROR_PARAMETER;
+    }
+    if(err == NSAPI_ERROR_OK) {
+        if(u8Code == COAP_MSG_CODE_EMPTY) {
+            err = coap_tcp_send_frame(COAP_TCP_CODE_PING, pu8Token, u8Tkl, NULL, 0);
+        }
+        else {
+            err = coap_tcp_send_frame(u8Code, pu8Token, u8Tkl, pu8Msg + _tSize - u32BodyLen, u32BodyLen);
+        }
+    }
+    g_tTcpMutex.unlock();
+
+    return (err == NSAPI_ERROR_OK) ? (nsapi_size_or_error_t)_tSize : err;
+}
+
+// Handle one whole frame, returns the length of the UDP form written to _pu8Out or -1 when consumed here
+static int coap_tcp_deliver(const uint8_t *_pu8Frame, uint32_t _u32HdrLen, uint32_t _u32BodyLen, uint8_t *_pu8Out, uint32_t _u32OutSize)
+{
+    uint8_t u8Tkl = _pu8Frame[0] & 0x0F;
+    uint8_t u8Code = _pu8Frame[_u32HdrLen - u8Tkl - 1];
+    const uint8_t *pu8Token = &_pu8Frame[_u32HdrLen - u8Tkl];
+    const uint8_t *pu8Body = &_pu8Frame[_u32HdrLen];
+
+    switch(u8Code) {
+    case COAP_TCP_CODE_CSM:
+        coap_tcp_parse_csm(pu8Body, _u32BodyLen);
+        g_tTcpFlags.set(COAP_TCP_FLAG_CSM);
+        return -1;
+    case COAP_TCP_CODE_PING:
+        g_tTcpMutex.lock();
+        coap_tcp_send_frame(COAP_TCP_CODE_PONG, pu8Token, u8Tkl, NULL, 0);
+        g_tTcpMutex.unlock();
+        return -1;
+    case COAP_TCP_CODE_PONG:
+        if(u8Tkl != 2) {
+            return -1;
+        }
+        _pu8Out[0] = COAP_VERSION_1 | COAP_MSG_TYPE_RESET;
+        _pu8Out[1] = COAP_MSG_CODE_EMPTY;
+        _pu8Out[2] = pu8Token[0];
+        _pu8Out[3] = pu8Token[1];
+        return 4;
+    case COAP_TCP_CODE_RELEASE:
+    case COAP_TCP_CODE_ABORT:
+        print_function("TCP peer closed the connection, code %d.%02d\n", u8Code >> 5, u8Code & 0x1F);
+        g_tTcpMutex.lock();
+        coap_tcp_drop();
+        g_tTcpMutex.unlock();
+        return -1;
+    default:
+        break;
+    }
+
+    if(4 + u8Tkl + _u32BodyLen > _u32OutSize) {
+        print_function("Drop %lu bytes TCP message, buffer too small\n", (unsigned long)_u32BodyLen);
+        return -1;
+    }
+    _pu8Out[0] = COAP_VERSION_1 | COAP_MSG_TYPE_ACKNOWLEDGEMENT | u8Tkl;
+    _pu8Out[1] = u8Code;
+    _pu8Out[2] = (u8Tkl == 2) ? pu8Token[0] : 0;
+    _pu8Out[3] = (u8Tkl == 2) ? pu8Token[1] : 0;
+    memcpy(&_pu8Out[4], pu8Token, u8Tkl);
+    memcpy(&_pu8Out[4 + u8Tkl], pu8Body, _u32BodyLen);
+    return 4 + u8Tkl + _u32BodyLen;
+}
+
+//
+// Returns the next message, NSAPI_ERROR_WOULD_BLOCK when nothing came within
+// COAP_TCP_POLL_MS, NSAPI_ERROR_NO_CONNECTION while there is no connection
+// and NSAPI_ERROR_CONNECTION_LOST once when it was lost with requests maybe
+// still waiting on it
+//
+static nsapi_size_or_error_t coap_tcp_recvfrom(SocketAddress *_ptAddr, void *_pvData, nsapi_size_t _tSize)
+{
+    static unsigned int uiGen = 0;
+    uint32_t u32HdrLen, u32BodyLen;
+    nsapi_size_or_error_t ret;
+    unsigned int uiSockGen;
+    int iLen;
+
+    while(1) {
+        g_tTcpMutex.lock();
+        if(uiGen != g_uiTcpGen) {
+            // Bytes of an older connection
+            uiGen = g_uiTcpGen;
+            g_u32TcpRxLen = 0;
+        }
+        uiSockGen = g_uiTcpGen;
+        *_ptAddr = g_tTcpPeer;
+        g_tTcpMutex.unlock();
+
+        if(coap_tcp_frame_len(g_u8TcpRxBuf, g_u32TcpRxLen, &u32HdrLen, &u32BodyLen)) {
+            iLen = coap_tcp_deliver(g_u8TcpRxBuf, u32HdrLen, u32BodyLen, (uint8_t *)_pvData, _tSize);
+            g_u32TcpRxLen -= u32HdrLen + u32BodyLen;
+            memmove(g_u8TcpRxBuf, g_u8TcpRxBuf + u32HdrLen + u32BodyLen, g_u32TcpRxLen);
+            if(iLen >= 0) {
+                return iLen;
+            }
+            continue;
+        }
+
+        if(!g_bTcpConnected) {
+            if(g_tTcpFlags.wait_any(COAP_TCP_FLAG_CONNECTED, COAP_TCP_POLL_MS, false) & osFlagsError) {
+                return NSAPI_ERROR_NO_CONNECTION;
+            }
+            continue;
+        }
+
+        if(g_u32TcpRxLen >= sizeof(g_u8TcpRxBuf)) {
+            print_function("TCP message over %d bytes, abort\n", COAP_TCP_MAX_MSG_SIZE);
+            g_tTcpMutex.lock();
+            coap_tcp_send_frame(COAP_TCP_CODE_ABORT, NULL, 0, NULL, 0);
+            coap_tcp_drop();
+            g_tTcpMutex.unlock();
+            return NSAPI_ERROR_CONNECTION_LOST;
+        }
+
+        ret = g_tTcpSocket.recv(g_u8TcpRxBuf + g_u32TcpRxLen, sizeof(g_u8TcpRxBuf) - g_u32TcpRxLen);
+        if(ret > 0) {
+            g_u32TcpRxLen += ret;
+            continue;
+        }
+        if(ret == NSAPI_ERROR_WOULD_BLOCK) {
+            return ret;
+        }
+
+        // 0 is an orderly close. A sender may have reconnected meanwhile, leave the new connection alone.
+        g_tTcpMutex.lock();
+        if(uiSockGen != g_uiTcpGen) {
+            g_tTcpMutex.unlock();
+            continue;
+        }
+        print_function("TCP connection lost: %d\n", ret);
+        coap_tcp_drop();
+        g_tTcpMutex.unlock();
+        return NSAPI_ERROR_CONNECTION_LOST;
+    }
+}
+
+// Only the blocking receive thread is supported
+static void coap_tcp_set_blocking(bool _bBlocking)
+{
+}
+
+static void coap_tcp_sigio(Callback<void()> _tFunc)
+{
+}
+
+static const TCoapTransport g_tTcpTransport = {
+    "tcp",
+    coap_tcp_open,
+    coap_tcp_close,
+    coap_tcp_sendto,
+    coap_tcp_recvfrom,
+    coap_tcp_set_blocking,
+    coap_tcp_sigio
+};
+
+const TCoapTransport* coap_transport_tcp(void)
+{
+    return &g_tTcpTransport;
+}
+
+unsigned int coap_tcp_get_connect_cnt(void)
+{
+    return g_uiTcpConnectCnt;
+}
+
+// False while connects are backed off, bulk senders then size their batches for UDP
+bool coap_tcp_ready(void)
+{
+    bool bReady;
+
+    g_tTcpMutex.lock();
+    bReady = g_bTcpConnected || g_u32TcpBackoffMs == 0 || Kernel::get_ms_count() >= g_u64TcpRetryMs;
+    g_tTcpMutex.unlock();
+    return bReady;
+}
+
+//
+// Recorder, prints every datagram passing through the lower transport
+//
+static const TCoapTransport *g_ptRecLower = NULL;
+static Mutex g_tRecMutex;
+static unsigned int g_uiRecSeq = 0;
+static uint64_t g_u64RecStartMs = 0;
+
+static void coap_rec_dump(char _cDir, const uint8_t *_pu8Data, uint16_t _u16Len)
+{
+    char aHex[COAP_TRACE_CHUNK_SIZE * 2 + 1];
+    uint64_t u64NowMs = Kernel::get_ms_count();
+    uint16_t u16Ofs = 0, u16Chunk, i;
+
+    g_tRecMutex.lock();
+    if(g_uiRecSeq == 0) {
+        g_u64RecStartMs = u64NowMs;
+    }
+
+    do {
+        u16Chunk = _u16Len - u16Ofs;
+        if(u16Chunk > COAP_TRACE_CHUNK_SIZE) {
+            u16Chunk = COAP_TRACE_CHUNK_SIZE;
+        }
+        for(i = 0; i < u16Chunk; i++) {
+            snprintf(&aHex[i * 2], 3, "%02x", _pu8Data[u16Ofs + i]);
+        }
+        aHex[u16Chunk * 2] = '\0';
+
+        print_function(COAP_TRACE_PREFIX "%u,%lu,%c,%u,%u,%s\n",
+                    g_uiRecSeq,
+                    (unsigned long)(u64NowMs - g_u64RecStartMs),
+                    _cDir,
+                    _u16Len,
+                    u16Ofs,
+                    aHex);
+        u16Ofs += u16Chunk;
+    } while(u16Ofs < _u16Len);
+
+    g_uiRecSeq++;
+    g_tRecMutex.unlock();
+}
+
+static nsapi_error_t coap_rec_open(NetworkInterface *_ptIface)
+{
+    return g_ptRecLower->pfnOpen(_ptIface);
+}
+
+static nsapi_error_t coap_rec_close(void)
+{
+    return g_ptRecLower->pfnClose();
+}
+
+static nsapi_size_or_error_t coap_rec_sendto(const SocketAddress &_tAddr, const void *_pvData, nsapi_size_t _tSize)
+{
+    nsapi_size_or_error_t ret = g_ptRecLower->pfnSendTo(_tAddr, _pvData, _tSize);
+
+    if(ret >= 0) {
+        coap_rec_dump(COAP_TRACE_DIR_TX, (const uint8_t *)_pvData, (uint16_t)_tSize);
+    }
+    return ret;
+}
+
+static nsapi_size_or_error_t coap_rec_recvfrom(SocketAddress *_ptAddr, void *_pvData, nsapi_size_t _tSize)
+{
+    nsapi_size_or_error_t ret = g_ptRecLower->pfnRecvFrom(_ptAddr, _pvData, _tSize);
+
+    if(ret >= 0) {
+        coap_rec_dump(COAP_TRACE_DIR_RX, (const uint8_t *)_pvData, (uint16_t)ret);
+    }
+    return ret;
+}
+
+static void coap_rec_set_blocking(bool _bBlocking)
+{
+    g_ptRecLower->pfnSetBlocking(_bBlocking);
+}
+
+static void coap_rec_sigio(Callback<void()> _tFunc)
+{
+    g_ptRecLower->pfnSigio(_tFunc);
+}
+
+static const TCoapTransport g_tRecTransport = {
+    "recorder",
+    coap_rec_open,
+    coap_rec_close,
+    coap_rec_sendto,
+    coap_rec_recvfrom,
+    coap_rec_set_blocking,
+    coap_rec_sigio
+};
+
+const TCoapTransport* coap_transport_recorder(const TCoapTransport *_ptLower)
+{
+    g_ptRecLower = _ptLower;
+    return &g_tRecTransport;
+}
+
+//
+// Impairment, drops datagrams in both directions and delays sends by a
+// random jitter to emulate a poor link in load tests
+//
+static const TCoapTransport *g_ptImpLower = NULL;
+static unsigned int g_uiImpLossPct = 0;
+static uint32_t g_u32ImpJitterMs = 0;
+static unsigned int g_uiImpTxDrop = 0;
+static unsigned int g_uiImpRxDrop = 0;
+
+static nsapi_error_t coap_imp_open(NetworkInterface *_ptIface)
+{
+    return g_ptImpLower->pfnOpen(_ptIface);
+}
+
+static nsapi_error_t coap_imp_close(void)
+{
+    return g_ptImpLower->pfnClose();
+}
+
+static nsapi_size_or_error_t coap_imp_sendto(const SocketAddress &_tAddr, const void *_pvData, nsapi_size_t _tSize)
+{
+    if((unsigned int)(rand() % 100) < g_uiImpLossPct) {
+        g_uiImpTxDrop++;
+        return _tSize;
+    }
+    if(g_u32ImpJitterMs > 0) {
+        ThisThread::sleep_for(rand() % (g_u32ImpJitterMs + 1));
+    }
+    return g_ptImpLower->pfnSendTo(_tAddr, _pvData, _tSize);
+}
+
+static nsapi_size_or_error_t coap_imp_recvfrom(SocketAddress *_ptAddr, void *_pvData, nsapi_size_t _tSize)
+{
+    nsapi_size_or_error_t ret;
+
+    while((ret = g_ptImpLower->pfnRecvFrom(_ptAddr, _pvData, _tSize)) >= 0) {
+        if((unsigned int)(rand() % 100) >= g_uiImpLossPct) {
+            break;
+        }
+        g_uiImpRxDrop++;
+    }
+    return ret;
+}
+
+static void coap_imp_set_blocking(bool _bBlocking)
+{
+    g_ptImpLower->pfnSetBlocking(_bBlocking);
+}
+
+static void coap_imp_sigio(Callback<void()> _tFunc)
+{
+    g_ptImpLower->pfnSigio(_tFunc);
+}
+
+static const TCoapTransport g_tImpTransport = {
+    "impair",
+    coap_imp_open,
+    coap_imp_close,
+    coap_imp_sendto,
+    coap_imp_recvfrom,
+    coap_imp_set_blocking,
+    coap_imp_sigio
+};
+
+const TCoapTransport* coap_transport_impair(const TCoapTransport *_ptLower, unsigned int _uiLossPct, uint32_t _u32JitterMs)
+{
+    g_ptImpLower = _ptLower;
+    g_uiImpLossPct = _uiLossPct;
+    g_u32ImpJitterMs = _u32JitterMs;
+    return &g_tImpTransport;
+}
+
+void coap_impair_get_stats(unsigned int *_puiTxDrop, unsigned int *_puiRxDrop)
+{
+    *_puiTxDrop = g_uiImpTxDrop;
+    *_puiRxDrop = g_uiImpRxDrop;
+}
+
+//
+// Replayer, feeds a captured trace back to the CoAP layer.
+// Received datagrams are released relative to the live send time of the
+// request they answered in the capture (realtime), or as soon as the
+// receiver asks for them. Message IDs in ACKs and resets, and 2-byte
+// tokens in any reply, are rewritten to follow the live request so the upper
+// layers match them as usual, separate responses included.
+//
+#define REPLAY_POLL_MS  1
+#define REPLAY_ID_NUM   8       // Recent requests whose replies can still be mapped
+
+static TCoapTraceRecord *g_ptReplayRec = NULL;
+static unsigned int g_uiReplayNum = 0;
+static unsigned int g_uiReplayPos = 0;
+static int g_iReplayRealtime = 1;
+static uint64_t g_u64ReplayStartMs = 0;
+static uint64_t g_u64ReplayEndMs = 0;
+static uint64_t g_u64LastTxLiveMs = 0;
+static uint32_t g_u32LastTxCapMs = 0;
+static uint16_t g_u16CapMsgId[REPLAY_ID_NUM];
+static uint16_t g_u16LiveMsgId[REPLAY_ID_NUM];
+static unsigned int g_uiReplayIdPos = 0;
+static TCoapReplayStats g_tReplayStats;
+static Mutex g_tReplayMutex;
+static bool g_bReplayBlocking = true;
+static Callback<void()> g_tReplaySigio;
+static bool g_bReplaySigio = false;
+
+static int coap_hex_val(char _c)
+{
+    if(_c >= '0' && _c <= '9') return _c - '0';
+    if(_c >= 'a' && _c <= 'f') return _c - 'a' + 10;
+    if(_c >= 'A' && _c <= 'F') return _c - 'A' + 10;
+    return -1;
+}
+
+// Live message ID of the request captured with _u16CapMsgId, or _u16CapMsgId when not seen lately
+static uint16_t coap_replay_live_id(uint16_t _u16CapMsgId)
+{
+    unsigned int i;
+
+    for(i = 0; i < REPLAY_ID_NUM; i++) {
+        if(g_u16CapMsgId[i] == _u16CapMsgId) {
+            return g_u16LiveMsgId[i];
+        }
+    }
+    return _u16CapMsgId;
+}
+
+// Rewrite a 16-bit field in place from the captured to the live message ID
+static void coap_replay_map_id(uint8_t *_pu8Field)
+{
+    uint16_t u16Id = coap_replay_live_id((uint16_t)(_pu8Field[0] << 8 | _pu8Field[1]));
+
+    _pu8Field[0] = (uint8_t)(u16Id >> 8);
+    _pu8Field[1] = (uint8_t)(u16Id & 0xFF);
+}
+
+//
+// Compare from _u16Ofs on, skipping the values of "time" members: readings
+// are stamped from the live clock when their batch is built. The stamps have
+// a fixed length, so both sides stay aligned.
+//
+static int coap_replay_same_body(const uint8_t *_pu8Cap, const uint8_t *_pu8Live, uint16_t _u16Ofs, uint16_t _u16Len)
+{
+    static const char strKey[] = "\"time\":\"";
+    const uint16_t u16KeyLen = sizeof(strKey) - 1;
+    uint16_t i = _u16Ofs;
+
+    while(i < _u16Len) {
+        if(_pu8Cap[i] != _pu8Live[i]) {
+            return 0;
+        }
+        if(_u16Len - i >= u16KeyLen && memcmp(&_pu8Cap[i], strKey, u16KeyLen) == 0 && memcmp(&_pu8Live[i], strKey, u16KeyLen) == 0) {
+            for(i += u16KeyLen; i < _u16Len && _pu8Cap[i] != '"' && _pu8Live[i] != '"'; i++) {
+            }
+            continue;
+        }
+        i++;
+    }
+    return 1;
+}
+
+// Same message apart from the message ID, a 2-byte token and reading stamps, all follow the live run
+static int coap_replay_same(const uint8_t *_pu8Cap, const uint8_t *_pu8Live, uint16_t _u16Len)
+{
+    uint16_t u16Ofs = 4;
+
+    if(_u16Len < 4) {
+        return memcmp(_pu8Cap, _pu8Live, _u16Len) == 0;
+    }
+    if(memcmp(_pu8Cap, _pu8Live, 2) != 0) {
+        return 0;
+    }
+    if((_pu8Cap[0] & 0x0F) == 2 && _u16Len >= 6) {
+        u16Ofs = 6;
+    }
+    return coap_replay_same_body(_pu8Cap, _pu8Live, u16Ofs, _u16Len);
+}
+
+static const char* coap_replay_next_line(const char *_strLine)
+{
+    const char *pcEnd = strchr(_strLine, '\n');
+
+    return (pcEnd != NULL) ? pcEnd + 1 : NULL;
+}
+
+// Parse one "#CT," line, returns 0 and fills the fields on success
+static int coap_replay_parse_line(const char *_strLine, unsigned int *_puiSeq, unsigned long *_pulMs,
+                                  char *_pcDir, unsigned int *_puiLen, unsigned int *_puiOfs, const char **_pstrHex)
+{
+    int iConsumed = 0;
+
+    if(sscanf(_strLine, COAP_TRACE_PREFIX "%u,%lu,%c,%u,%u,%n",
+              _puiSeq, _pulMs, _pcDir, _puiLen, _puiOfs, &iConsumed) != 5 || iConsumed == 0) {
+        return -1;
+    }
+    if(*_pcDir != COAP_TRACE_DIR_TX && *_pcDir != COAP_TRACE_DIR_RX) {
+        return -1;
+    }
+    *_pstrHex = _strLine + iConsumed;
+    return 0;
+}
+
+void coap_replay_unload(void)
+{
+    unsigned int i;
+
+    g_tReplayMutex.lock();
+    for(i = 0; i < g_uiReplayNum; i++) {
+        free(g_ptReplayRec[i].pu8Data);
+    }
+    free(g_ptReplayRec);
+    g_ptReplayRec = NULL;
+    g_uiReplayNum = 0;
+    g_uiReplayPos = 0;
+    g_tReplayMutex.unlock();
+}
+
+int coap_replay_load(const char *_strTrace, int _iRealtime)
+{
+    const char *pcLine, *pcHex;
+    unsigned int uiSeq, uiLen, uiOfs, uiNum, uiLastSeq;
+    unsigned long ulMs;
+    char cDir;
+    int iPass, iHi, iLo;
+    TCoapTraceRecord *ptRec = NULL;
+
+    if(_strTrace == NULL) {
+        return -1;
+    }
+    coap_replay_unload();
+
+    // First pass counts the records, second pass fills them
+    for(iPass = 0; iPass < 2; iPass++) {
+        uiNum = 0;
+        uiLastSeq = 0;
+        for(pcLine = _strTrace; pcLine != NULL && *pcLine != '\0'; pcLine = coap_replay_next_line(pcLine)) {
+            if(strncmp(pcLine, COAP_TRACE_PREFIX, strlen(COAP_TRACE_PREFIX)) != 0) {
+                continue;
+            }
+            if(coap_replay_parse_line(pcLine, &uiSeq, &ulMs, &cDir, &uiLen, &uiOfs, &pcHex) != 0) {
+                if(iPass == 0) {
+                    print_function("Replay: skip malformed line\n");
+                }
+                continue;
+            }
+            if(uiOfs == 0 || uiNum == 0 || uiSeq != uiLastSeq) {
+                uiNum++;
+                uiLastSeq = uiSeq;
+                if(iPass == 1) {
+                    ptRec = &g_ptReplayRec[uiNum - 1];
+                    ptRec->u32TimeMs = (uint32_t)ulMs;
+                    ptRec->cDir = cDir;
+                    ptRec->u16Len = (uint16_t)uiLen;
+                    ptRec->pu8Data = (uint8_t *)malloc(uiLen > 0 ? uiLen : 1);
+                    if(ptRec->pu8Data == NULL) {
+                        g_uiReplayNum = uiNum - 1;
+                        coap_replay_unload();
+                        return -1;
+                    }
+                }
+            }
+            if(iPass == 1) {
+                for(; uiOfs < ptRec->u16Len; uiOfs++, pcHex += 2) {
+                    iHi = coap_hex_val(pcHex[0]);
+                    iLo = (iHi < 0) ? -1 : coap_hex_val(pcHex[1]);
+                    if(iLo < 0) {
+                        break;
+                    }
+                    ptRec->pu8Data[uiOfs] = (uint8_t)((iHi << 4) | iLo);
+                }
+            }
+        }
+
+        if(uiNum == 0) {
+            print_function("Replay: no records in trace\n");
+            return -1;
+        }
+        if(iPass == 0) {
+            g_ptReplayRec = (TCoapTraceRecord *)calloc(uiNum, sizeof(TCoapTraceRecord));
+            if(g_ptReplayRec == NULL) {
+                return -1;
+            }
+            g_uiReplayNum = uiNum;
+        }
+    }
+
+    memset(&g_tReplayStats, 0, sizeof(g_tReplayStats));
+    g_tReplayStats.u32CapturedMs = g_ptReplayRec[g_uiReplayNum - 1].u32TimeMs;
+    g_iReplayRealtime = _iRealtime;
+    g_uiReplayPos = 0;
+    g_u64ReplayStartMs = 0;
+    g_u64ReplayEndMs = 0;
+    g_u64LastTxLiveMs = Kernel::get_ms_count();
+    g_u32LastTxCapMs = 0;
+    memset(g_u16CapMsgId, 0, sizeof(g_u16CapMsgId));
+    memset(g_u16LiveMsgId, 0, sizeof(g_u16LiveMsgId));
+    g_uiReplayIdPos = 0;
+
+    print_function("Replay: loaded %u records, %s\n", g_uiReplayNum, _iRealtime ? "realtime" : "fast");
+    return 0;
+}
+
+int coap_replay_done(void)
+{
+    int iDone;
+
+    g_tReplayMutex.lock();
+    iDone = (g_uiReplayPos >= g_uiReplayNum);
+    g_tReplayMutex.unlock();
+    return iDone;
+}
+
+void coap_replay_get_stats(TCoapReplayStats *_ptStats)
+{
+    g_tReplayMutex.lock();
+    *_ptStats = g_tReplayStats;
+    if(g_u64ReplayStartMs != 0) {
+        _ptStats->u32ElapsedMs = (uint32_t)((g_u64ReplayEndMs ? g_u64ReplayEndMs : Kernel::get_ms_count()) - g_u64ReplayStartMs);
+    }
+    g_tReplayMutex.unlock();
+}
+
+void coap_replay_report(void)
+{
+    TCoapReplayStats tStats;
+
+    coap_replay_get_stats(&tStats);
+    print_function("Replay: tx:%u, rx:%u, mismatch:%u, elapsed:%lums, captured:%lums\n",
+                tStats.uiTxCnt,
+                tStats.uiRxCnt,
+                tStats.uiMismatchCnt,
+                (unsigned long)tStats.u32ElapsedMs,
+                (unsigned long)tStats.u32CapturedMs);
+}
+
+// Live time at which the next received record should be delivered
+static uint64_t coap_replay_due_ms(const TCoapTraceRecord *_ptRec, uint64_t _u64NowMs)
+{
+    if(g_iReplayRealtime && _ptRec->u32TimeMs > g_u32LastTxCapMs) {
+        return g_u64LastTxLiveMs + (_ptRec->u32TimeMs - g_u32LastTxCapMs);
+    }
+    return _u64NowMs;
+}
+
+// Non-blocking mode, raise sigio from the event queue when the next reply is due
+static void coap_replay_notify(uint64_t _u64NowMs)
+{
+    uint64_t u64DueMs;
+
+    if(g_bReplayBlocking || !g_bReplaySigio) {
+        return;
+    }
+    if(g_uiReplayPos < g_uiReplayNum && g_ptReplayRec[g_uiReplayPos].cDir == COAP_TRACE_DIR_RX) {
+        u64DueMs = coap_replay_due_ms(&g_ptReplayRec[g_uiReplayPos], _u64NowMs);
+        mbed_event_queue()->call_in((int)(u64DueMs - _u64NowMs), g_tReplaySigio);
+    }
+}
+
+static void coap_replay_advance(uint64_t _u64NowMs)
+{
+    g_uiReplayPos++;
+    if(g_uiReplayPos >= g_uiReplayNum) {
+        g_u64ReplayEndMs = _u64NowMs;
+    }
+}
+
+static nsapi_error_t coap_replay_open(NetworkInterface *_ptIface)
+{
+    return (g_ptReplayRec != NULL) ? NSAPI_ERROR_OK : NSAPI_ERROR_NO_SOCKET;
+}
+
+static nsapi_error_t coap_replay_close(void)
+{
+    return NSAPI_ERROR_OK;
+}
+
+static nsapi_size_or_error_t coap_replay_sendto(const SocketAddress &_tAddr, const void *_pvData, nsapi_size_t _tSize)
+{
+    const uint8_t *pu8Data = (const uint8_t *)_pvData;
+    uint64_t u64NowMs = Kernel::get_ms_count();
+    TCoapTraceRecord *ptRec;
+
+    g_tReplayMutex.lock();
+    if(g_u64ReplayStartMs == 0) {
+        g_u64ReplayStartMs = u64NowMs;
+    }
+
+    // Replies the client never waited for in this run are dropped
+    while(g_uiReplayPos < g_uiReplayNum && g_ptReplayRec[g_uiReplayPos].cDir != COAP_TRACE_DIR_TX) {
+        g_tReplayStats.uiMismatchCnt++;
+        coap_replay_advance(u64NowMs);
+    }
+
+    g_tReplayStats.uiTxCnt++;
+    if(g_uiReplayPos >= g_uiReplayNum) {
+        g_tReplayStats.uiMismatchCnt++;
+        g_tReplayMutex.unlock();
+        return _tSize;
+    }
+
+    ptRec = &g_ptReplayRec[g_uiReplayPos];
+    if(ptRec->u16Len != _tSize || !coap_replay_same(ptRec->pu8Data, pu8Data, (uint16_t)_tSize)) {
+        g_tReplayStats.uiMismatchCnt++;
+    }
+    if(ptRec->u16Len >= 4 && _tSize >= 4) {
+        g_u16CapMsgId[g_uiReplayIdPos] = (uint16_t)(ptRec->pu8Data[2] << 8 | ptRec->pu8Data[3]);
+        g_u16LiveMsgId[g_uiReplayIdPos] = (uint16_t)(pu8Data[2] << 8 | pu8Data[3]);
+        g_uiReplayIdPos = (g_uiReplayIdPos + 1) % REPLAY_ID_NUM;
+    }
+    g_u32LastTxCapMs = ptRec->u32TimeMs;
+    g_u64LastTxLiveMs = u64NowMs;
+    coap_replay_advance(u64NowMs);
+    coap_replay_notify(u64NowMs);
+    g_tReplayMutex.unlock();
+
+    return _tSize;
+}
+
+static nsapi_size_or_error_t coap_replay_recvfrom(SocketAddress *_ptAddr, void *_pvData, nsapi_size_t _tSize)
+{
+    TCoapTraceRecord *ptRec;
+    uint64_t u64NowMs, u64DueMs;
+    uint16_t u16Len;
+    uint8_t *pu8Data = (uint8_t *)_pvData;
+
+    while(1) {
+        g_tReplayMutex.lock();
+        u64NowMs = Kernel::get_ms_count();
+        if(g_uiReplayPos < g_uiReplayNum && g_ptReplayRec[g_uiReplayPos].cDir == COAP_TRACE_DIR_RX) {
+            ptRec = &g_ptReplayRec[g_uiReplayPos];
+            u64DueMs = coap_replay_due_ms(ptRec, u64NowMs);
+            if(u64NowMs >= u64DueMs) {
+                u16Len = (ptRec->u16Len < _tSize) ? ptRec->u16Len : (uint16_t)_tSize;
+                memcpy(pu8Data, ptRec->pu8Data, u16Len);
+                // A CON or NON keeps the server's message ID, the token ties it to the request
+                if(u16Len >= 4 && (pu8Data[0] & COAP_MSG_TYPE_ACKNOWLEDGEMENT)) {
+                    coap_replay_map_id(&pu8Data[2]);
+                }
+                if(u16Len >= 6 && (pu8Data[0] & 0x0F) == 2) {
+                    coap_replay_map_id(&pu8Data[4]);
+                }
+                g_tReplayStats.uiRxCnt++;
+                coap_replay_advance(u64NowMs);
+                coap_replay_notify(u64NowMs);
+                g_tReplayMutex.unlock();
+                return u16Len;
+            }
+        }
+        g_tReplayMutex.unlock();
+
+        if(!g_bReplayBlocking) {
+            return NSAPI_ERROR_WOULD_BLOCK;
+        }
+
+        // Nothing due yet, behave like a socket that has no traffic
+        ThisThread::sleep_for(REPLAY_POLL_MS);
+    }
+}
+
+static void coap_replay_set_blocking(bool _bBlocking)
+{
+    g_bReplayBlocking = _bBlocking;
+}
+
+static void coap_replay_sigio(Callback<void()> _tFunc)
+{
+    g_tReplayMutex.lock();
+    g_tReplaySigio = _tFunc;
+    g_bReplaySigio = true;
+    g_tReplayMutex.unlock();
+}
+
+static const TCoapTransport g_tReplayTransport = {
+    "replayer",
+    coap_replay_open,
+    coap_replay_close,
+    coap_replay_sendto,
+    coap_replay_recvfrom,
+    coap_replay_set_blocking,
+    coap_replay_sigio
+};
+
+const TCoapTransport* coap_transport_replayer(void)
+{
+    return &g_tReplayTransport;
+}
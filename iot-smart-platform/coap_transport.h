@@ -0,0 +1,80 @@
+#ifndef __COAP_TRANSPORT_H__
+#define __COAP_TRANSPORT_H__
+
+#include <mbed.h>
+
+//
+// Datagram transport used underneath coap_post/coap_get and the receive thread.
+// The default is the cellular UDP socket; the recorder wraps it and dumps every
+// datagram to the console, the replayer feeds a captured trace back instead of
+// touching the network. The TCP transport carries the same messages over one
+// persistent RFC 8323 connection, see coap_post_bulk.
+//
+typedef struct _TCoapTransport {
+    const char *strName;
+    nsapi_error_t (*pfnOpen)(NetworkInterface *_ptIface);
+    nsapi_error_t (*pfnClose)(void);
+    nsapi_size_or_error_t (*pfnSendTo)(const SocketAddress &_tAddr, const void *_pvData, nsapi_size_t _tSize);
+    nsapi_size_or_error_t (*pfnRecvFrom)(SocketAddress *_ptAddr, void *_pvData, nsapi_size_t _tSize);
+    void (*pfnSetBlocking)(bool _bBlocking);
+    void (*pfnSigio)(Callback<void()> _tFunc);
+} TCoapTransport;
+
+// Non-blocking UDP sends that meet a busy modem, see coap_udp_sendto
+#define COAP_UDP_SEND_RETRY_NUM     10
+#define COAP_UDP_SEND_RETRY_MS      10
+
+// CoAP over TCP
+#define COAP_TCP_MAX_MSG_SIZE       2048    // Announced in our CSM, also the size of the receive buffer
+#define COAP_TCP_DEFAULT_MSG_SIZE   1152    // Peer's limit until its CSM arrives, RFC 8323 5.3.1
+#define COAP_TCP_POLL_MS            1000    // Socket timeout, the receiver polls at this rate
+#define COAP_TCP_CONNECT_TIMEOUT_MS 30000   // Cellular handshakes can take a while
+#define COAP_TCP_CSM_TIMEOUT_MS     10000   // Wait for the peer's CSM, then go on with the defaults
+#define COAP_TCP_SEND_TIMEOUT_MS    30000   // A stalled send drops the connection
+#define COAP_TCP_BACKOFF_MS         30000   // After a failed connect, doubled up to COAP_TCP_BACKOFF_MAX_MS
+#define COAP_TCP_BACKOFF_MAX_MS     600000
+
+//
+// Capture format, one line per chunk of up to COAP_TRACE_CHUNK_SIZE bytes:
+//   #CT,<seq>,<ms>,<T|R>,<len>,<offset>,<hex bytes>
+// <ms> is relative to the first recorded datagram. Lines not starting with the
+// prefix are ignored, so a raw console log can be replayed as it is.
+//
+#define COAP_TRACE_PREFIX       "#CT,"
+#define COAP_TRACE_CHUNK_SIZE   32
+
+#define COAP_TRACE_DIR_TX       'T'
+#define COAP_TRACE_DIR_RX       'R'
+
+typedef struct _TCoapTraceRecord {
+    uint32_t u32TimeMs;
+    char cDir;
+    uint16_t u16Len;
+    uint8_t *pu8Data;
+} TCoapTraceRecord;
+
+typedef struct _TCoapReplayStats {
+    unsigned int uiTxCnt;
+    unsigned int uiRxCnt;
+    unsigned int uiMismatchCnt;
+    uint32_t u32ElapsedMs;
+    uint32_t u32CapturedMs;
+} TCoapReplayStats;
+
+const TCoapTransport* coap_transport_udp(void);
+const TCoapTransport* coap_transport_tcp(void);
+const TCoapTransport* coap_transport_recorder(const TCoapTransport *_ptLower);
+const TCoapTransport* coap_transport_replayer(void);
+const TCoapTransport* coap_transport_impair(const TCoapTransport *_ptLower, unsigned int _uiLossPct, uint32_t _u32JitterMs);
+
+void coap_impair_get_stats(unsigned int *_puiTxDrop, unsigned int *_puiRxDrop);
+unsigned int coap_tcp_get_connect_cnt(void);
+bool coap_tcp_ready(void);
+
+int coap_replay_load(const char *_strTrace, int _iRealtime);
+void coap_replay_unload(void);
+int coap_replay_done(void);
+void coap_replay_get_stats(TCoapReplayStats *_ptStats);
+void coap_replay_report(void);
+
+#endif // End of __COAP_TRANSPORT_H__
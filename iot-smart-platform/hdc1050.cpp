@@ -1,13 +1,30 @@
 
 #include <mbed.h>
+#include <debug_print.h>
+#include "i2c_bus.h"
 #include "hdc1050.h"
 
-I2C i2c0(I2C0_SDA,I2C0_SCL);
+static TI2CDevice g_tHdc1050;
+static TI2CTransaction g_tTrans;
+static Mutex g_tTransMutex;
 
-void  HDC1050_Init(void)
+static const char g_cManufacturerIdAddr = TI_HDC1050_MANUFACTURER_ID_ADDR;
+static const char g_cTemperatureAddr = TI_HDC1050_TEMPERATURE_ADDR;
+
+int  HDC1050_Init(void)
 {
-    I2C *i2c = &i2c0;
-    i2c->frequency(100000);
+    uint16_t u16VendorId;
+
+    // Called again when the sensor did not answer, the device is on the bus list already
+    if(g_tHdc1050.strName == NULL) {
+        i2c_bus_attach(&g_tHdc1050, "hdc1050", TI_HDC1050_DEVICE_ADDR);
+    }
+    u16VendorId = HDC1050_GetVendorID();
+    if(u16VendorId != TI_HDC1050_MANUFACTURER_ID) {
+        print_function("HDC1050 not found, vendor ID 0x%04x\n", u16VendorId);
+        return -1;
+    }
+    return 0;
 }    
 
 void HDC1050_UnInit(void)
@@ -18,28 +35,56 @@ void HDC1050_UnInit(void)
 uint16_t  HDC1050_GetVendorID(void)
 {
     char rxBuff[2];
-    char ofs = TI_HDC1050_MANUFACTURER_ID_ADDR;
     uint16_t   RetVal = 0;
-    I2C *i2c = &i2c0;
 
-    i2c->write(TI_HDC1050_DEVICE_ADDR << 1, &ofs, 1);
-    i2c->read(TI_HDC1050_DEVICE_ADDR << 1, rxBuff, 2);
-    RetVal  = ((uint16_t)rxBuff[0]) << 8 | (uint16_t)    rxBuff[1];
+    // Pointer write and read with a repeated start, in one transfer
+    g_tTransMutex.lock();
+    g_tTrans.ptDev = &g_tHdc1050;
+    g_tTrans.u8StepNum = 1;
+    g_tTrans.tStep[0].pcTx = &g_cManufacturerIdAddr;
+    g_tTrans.tStep[0].u8TxLen = 1;
+    g_tTrans.tStep[0].pcRx = rxBuff;
+    g_tTrans.tStep[0].u8RxLen = 2;
+    g_tTrans.tStep[0].u16DelayMs = 0;
+    if(i2c_bus_run(&g_tTrans) == I2C_BUS_OK) {
+        RetVal  = ((uint16_t)rxBuff[0]) << 8 | (uint16_t)    rxBuff[1];
+    }
+    g_tTransMutex.unlock();
          
     return RetVal;     
 }    
 
-void  HDC1050_GetSensorData(float *Temperature, uint16_t *Humidity)
+int  HDC1050_GetSensorData(float *Temperature, uint16_t *Humidity)
 {
     char rxBuff[4];
-    char ofs = TI_HDC1050_TEMPERATURE_ADDR;
     uint16_t humidity;
     float temperature;
-    I2C *i2c = &i2c0;
+    int iRet;
 
-    i2c->write(TI_HDC1050_DEVICE_ADDR << 1, &ofs, 1);
-    wait_ms(100);
-    i2c->read(TI_HDC1050_DEVICE_ADDR << 1, rxBuff, 4);
+    //
+    // Trigger both measurements, then read them in one go once converted,
+    // the bus serves other sensors meanwhile
+    //
+    g_tTransMutex.lock();
+    g_tTrans.ptDev = &g_tHdc1050;
+    g_tTrans.u8StepNum = 2;
+    g_tTrans.tStep[0].pcTx = &g_cTemperatureAddr;
+    g_tTrans.tStep[0].u8TxLen = 1;
+    g_tTrans.tStep[0].pcRx = NULL;
+    g_tTrans.tStep[0].u8RxLen = 0;
+    g_tTrans.tStep[0].u16DelayMs = 0;
+    g_tTrans.tStep[1].pcTx = NULL;
+    g_tTrans.tStep[1].u8TxLen = 0;
+    g_tTrans.tStep[1].pcRx = rxBuff;
+    g_tTrans.tStep[1].u8RxLen = 4;
+    g_tTrans.tStep[1].u16DelayMs = TI_HDC1050_CONVERSION_MS;
+    iRet = i2c_bus_run(&g_tTrans);
+    g_tTransMutex.unlock();
+
+    if(iRet != I2C_BUS_OK) {
+        print_function("Read HDC1050 failed (%d)!\n", iRet);
+        return -1;
+    }
 
     temperature = (float)(( rxBuff[0] << 8) | (rxBuff[1] ));
     temperature = (temperature*165)/65536-40;
@@ -50,5 +95,5 @@ void  HDC1050_GetSensorData(float *Temperature, uint16_t *Humidity)
         *Temperature = temperature;
     if(Humidity != NULL)
         *Humidity = humidity;
+    return 0;
 }
-
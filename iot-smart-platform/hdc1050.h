@@ -44,11 +44,13 @@ extern "C"
 #define TI_HDC1050_MANUFACTURER_ID          0x5449 
 #define TI_HDC1050_DEVICE_ID                0x1050
 
+#define TI_HDC1050_CONVERSION_MS            15      // 14 bit temperature and humidity, 6.35 + 6.5 ms
 
-void HDC1050_Init(void);
+
+int HDC1050_Init(void);
 void HDC1050_UnInit(void);
 uint16_t  HDC1050_GetVendorID(void);
-void HDC1050_GetSensorData(float *Temperature, uint16_t *Humidity);
+int HDC1050_GetSensorData(float *Temperature, uint16_t *Humidity);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,412 @@
+
+#include "mbed.h"
+#include <debug_print.h>
+#include <i2c_bus.h>
+
+#define I2C_BUS_FLAG_KICK           0x1
+
+static const TI2CBackend *g_ptBackend = NULL;
+static TI2CDevice *g_ptDevices = NULL;
+static TI2CTransaction *g_ptQueue = NULL;
+static TI2CTransaction *g_ptActive = NULL;
+static Mutex g_tBusMutex;
+static EventFlags g_tBusFlags;
+static Timer g_tBusClock;
+static Thread g_tBusThread(osPriorityAboveNormal, I2C_BUS_THREAD_STACK_SIZE);
+
+//
+// Hardware backend, DMA/interrupt driven when the target has I2C_ASYNCH
+//
+static I2C *g_ptI2C = NULL;
+#if DEVICE_I2C_ASYNCH
+static EventFlags g_tXferFlags;
+
+static void i2c_mbed_event(int _iEvent)
+{
+    g_tXferFlags.set(_iEvent & I2C_EVENT_ALL);
+}
+#endif // DEVICE_I2C_ASYNCH
+
+static int i2c_mbed_open(int _iFrequency)
+{
+    if(g_ptI2C == NULL) {
+        g_ptI2C = new I2C(I2C0_SDA, I2C0_SCL);
+    }
+    g_ptI2C->frequency(_iFrequency);
+    return 0;
+}
+
+static int i2c_mbed_transfer(uint8_t _u8Addr, const char *_pcTx, int _iTxLen, char *_pcRx, int _iRxLen)
+{
+#if DEVICE_I2C_ASYNCH
+    uint32_t u32Event;
+
+    g_tXferFlags.clear(I2C_EVENT_ALL);
+    if(g_ptI2C->transfer(_u8Addr << 1, _pcTx, _iTxLen, _pcRx, _iRxLen, callback(i2c_mbed_event), I2C_EVENT_ALL) != 0) {
+        return I2C_BUS_ERROR;
+    }
+
+    u32Event = g_tXferFlags.wait_any(I2C_EVENT_ALL, I2C_BUS_XFER_TIMEOUT_MS);
+    if(u32Event & osFlagsError) {
+        g_ptI2C->abort_transfer();
+        return I2C_BUS_TIMEOUT;
+    }
+    if(u32Event & (I2C_EVENT_ERROR_NO_SLAVE | I2C_EVENT_TRANSFER_EARLY_NACK)) {
+        return I2C_BUS_NACK;
+    }
+    if(u32Event & I2C_EVENT_ERROR) {
+        return I2C_BUS_ERROR;
+    }
+    return I2C_BUS_OK;
+#else
+    if(_iTxLen > 0 && g_ptI2C->write(_u8Addr << 1, _pcTx, _iTxLen, _iRxLen > 0) != 0) {
+        return I2C_BUS_NACK;
+    }
+    if(_iRxLen > 0 && g_ptI2C->read(_u8Addr << 1, _pcRx, _iRxLen) != 0) {
+        return I2C_BUS_NACK;
+    }
+    return I2C_BUS_OK;
+#endif // DEVICE_I2C_ASYNCH
+}
+
+static const TI2CBackend g_tBackendMbed = {
+    "mbed",
+    i2c_mbed_open,
+    i2c_mbed_transfer
+};
+
+const TI2CBackend *i2c_backend_mbed(void)
+{
+    return &g_tBackendMbed;
+}
+
+//
+// Mock backend, register files in RAM for boards without the sensors
+//
+#define I2C_MOCK_DEVICE_NUM         2
+
+typedef struct _TI2CMockDevice {
+    uint8_t u8Addr;
+    uint8_t u8Ptr;
+    unsigned int uiNackCnt;
+    uint16_t u16Reg[256];
+} TI2CMockDevice;
+
+static TI2CMockDevice g_tMockDevices[I2C_MOCK_DEVICE_NUM];
+static int g_iMockDeviceNum = 0;
+
+static TI2CMockDevice *i2c_mock_find(uint8_t _u8Addr)
+{
+    int i;
+
+    for(i = 0; i < g_iMockDeviceNum; i++) {
+        if(g_tMockDevices[i].u8Addr == _u8Addr) {
+            return &g_tMockDevices[i];
+        }
+    }
+    return NULL;
+}
+
+int i2c_mock_attach(uint8_t _u8Addr)
+{
+    if(i2c_mock_find(_u8Addr) != NULL) {
+        return 0;
+    }
+    if(g_iMockDeviceNum >= I2C_MOCK_DEVICE_NUM) {
+        return -1;
+    }
+
+    memset(&g_tMockDevices[g_iMockDeviceNum], 0, sizeof(TI2CMockDevice));
+    g_tMockDevices[g_iMockDeviceNum].u8Addr = _u8Addr;
+    g_iMockDeviceNum++;
+    return 0;
+}
+
+void i2c_mock_set_reg(uint8_t _u8Addr, uint8_t _u8Reg, uint16_t _u16Value)
+{
+    TI2CMockDevice *ptDev = i2c_mock_find(_u8Addr);
+
+    if(ptDev != NULL) {
+        ptDev->u16Reg[_u8Reg] = _u16Value;
+    }
+}
+
+// The next _uiCnt transfers to this address are NACKed
+void i2c_mock_inject_nack(uint8_t _u8Addr, unsigned int _uiCnt)
+{
+    TI2CMockDevice *ptDev = i2c_mock_find(_u8Addr);
+
+    if(ptDev != NULL) {
+        ptDev->uiNackCnt = _uiCnt;
+    }
+}
+
+static int i2c_mock_open(int _iFrequency)
+{
+    return 0;
+}
+
+static int i2c_mock_transfer(uint8_t _u8Addr, const char *_pcTx, int _iTxLen, char *_pcRx, int _iRxLen)
+{
+    TI2CMockDevice *ptDev = i2c_mock_find(_u8Addr);
+    int i;
+
+    if(ptDev == NULL) {
+        return I2C_BUS_NACK;
+    }
+    if(ptDev->uiNackCnt > 0) {
+        ptDev->uiNackCnt--;
+        return I2C_BUS_NACK;
+    }
+
+    // First byte is the register pointer, then big-endian register values
+    if(_iTxLen > 0) {
+        ptDev->u8Ptr = (uint8_t)_pcTx[0];
+        for(i = 1; i + 1 < _iTxLen; i += 2) {
+            ptDev->u16Reg[ptDev->u8Ptr++] = ((uint8_t)_pcTx[i] << 8) | (uint8_t)_pcTx[i + 1];
+        }
+    }
+    for(i = 0; i < _iRxLen; i++) {
+        _pcRx[i] = (i & 1) ? (char)(ptDev->u16Reg[ptDev->u8Ptr] & 0xFF) : (char)(ptDev->u16Reg[ptDev->u8Ptr] >> 8);
+        if(i & 1) {
+            ptDev->u8Ptr++;
+        }
+    }
+    return I2C_BUS_OK;
+}
+
+static const TI2CBackend g_tBackendMock = {
+    "mock",
+    i2c_mock_open,
+    i2c_mock_transfer
+};
+
+const TI2CBackend *i2c_backend_mock(void)
+{
+    return &g_tBackendMock;
+}
+
+//
+// Bus manager
+//
+static void i2c_bus_unlink(TI2CTransaction *_ptTrans)
+{
+    TI2CTransaction **pptCur;
+
+    for(pptCur = &g_ptQueue; *pptCur != NULL; pptCur = &(*pptCur)->ptNext) {
+        if(*pptCur == _ptTrans) {
+            *pptCur = _ptTrans->ptNext;
+            _ptTrans->ptNext = NULL;
+            return;
+        }
+    }
+}
+
+static void i2c_bus_complete(TI2CTransaction *_ptTrans, int _iResult)
+{
+    TI2CDevice *ptDev = _ptTrans->ptDev;
+    uint32_t u32Us = (uint32_t)(g_tBusClock.read_high_resolution_us() - _ptTrans->u64SubmitUs);
+
+    g_tBusMutex.lock();
+    i2c_bus_unlink(_ptTrans);
+    ptDev->uiTransCnt++;
+    if(_iResult != I2C_BUS_OK) {
+        ptDev->uiErrCnt++;
+    }
+    ptDev->u32LastUs = u32Us;
+    ptDev->u64TotalUs += u32Us;
+    if(u32Us > ptDev->u32MaxUs) {
+        ptDev->u32MaxUs = u32Us;
+    }
+    _ptTrans->iResult = _iResult;
+    g_tBusMutex.unlock();
+
+    _ptTrans->tDone.release();
+}
+
+// Run the next step of a transaction, it stays queued while steps remain
+static void i2c_bus_step(TI2CTransaction *_ptTrans)
+{
+    TI2CStep *ptStep = &_ptTrans->tStep[_ptTrans->u8Step];
+    int iRet;
+
+    iRet = g_ptBackend->pfnTransfer(_ptTrans->ptDev->u8Addr, ptStep->pcTx, ptStep->u8TxLen, ptStep->pcRx, ptStep->u8RxLen);
+    if(iRet == I2C_BUS_NACK) {
+        g_tBusMutex.lock();
+        _ptTrans->ptDev->uiNackCnt++;
+        g_tBusMutex.unlock();
+
+        // Busy devices NACK, e.g. during a conversion, so back off a little
+        if(_ptTrans->u8Retry++ < I2C_BUS_RETRY_CNT) {
+            _ptTrans->u64ReadyMs = Kernel::get_ms_count() + _ptTrans->u8Retry;
+            return;
+        }
+    }
+
+    if(iRet == I2C_BUS_OK && ++_ptTrans->u8Step < _ptTrans->u8StepNum) {
+        _ptTrans->u8Retry = 0;
+        _ptTrans->u64ReadyMs = Kernel::get_ms_count() + _ptTrans->tStep[_ptTrans->u8Step].u16DelayMs;
+        return;
+    }
+
+    i2c_bus_complete(_ptTrans, iRet);
+}
+
+static void i2c_bus_thread(void)
+{
+    TI2CTransaction *ptTrans;
+    uint64_t u64NowMs, u64WakeMs;
+
+    while(1) {
+        //
+        // Oldest transaction that is ready, queued ones keep their order so
+        // the steps of one transaction run back to back
+        //
+        g_tBusMutex.lock();
+        u64NowMs = Kernel::get_ms_count();
+        u64WakeMs = 0;
+        for(ptTrans = g_ptQueue; ptTrans != NULL; ptTrans = ptTrans->ptNext) {
+            if(ptTrans->u64ReadyMs <= u64NowMs) {
+                break;
+            }
+            if(u64WakeMs == 0 || ptTrans->u64ReadyMs < u64WakeMs) {
+                u64WakeMs = ptTrans->u64ReadyMs;
+            }
+        }
+        g_ptActive = ptTrans;
+        g_tBusMutex.unlock();
+
+        if(ptTrans == NULL) {
+            g_tBusFlags.wait_any(I2C_BUS_FLAG_KICK, u64WakeMs ? (uint32_t)(u64WakeMs - u64NowMs) : osWaitForever);
+            continue;
+        }
+
+        i2c_bus_step(ptTrans);
+
+        g_tBusMutex.lock();
+        g_ptActive = NULL;
+        g_tBusMutex.unlock();
+    }
+}
+
+int i2c_bus_init(const TI2CBackend *_ptBackend)
+{
+    if(g_ptBackend != NULL) {
+        return 0;
+    }
+
+    if(_ptBackend->pfnOpen(I2C_BUS_FREQUENCY) != 0) {
+        print_function("Open I2C bus (%s) failed!\n", _ptBackend->strName);
+        return -1;
+    }
+    g_ptBackend = _ptBackend;
+    g_tBusClock.start();
+    g_tBusThread.start(i2c_bus_thread);
+    return 0;
+}
+
+void i2c_bus_attach(TI2CDevice *_ptDev, const char *_strName, uint8_t _u8Addr)
+{
+    g_tBusMutex.lock();
+    memset(_ptDev, 0, sizeof(TI2CDevice));
+    _ptDev->strName = _strName;
+    _ptDev->u8Addr = _u8Addr;
+    _ptDev->ptNext = g_ptDevices;
+    g_ptDevices = _ptDev;
+    g_tBusMutex.unlock();
+}
+
+int i2c_bus_submit(TI2CTransaction *_ptTrans)
+{
+    TI2CTransaction **pptTail;
+
+    if(g_ptBackend == NULL || _ptTrans->ptDev == NULL || _ptTrans->u8StepNum == 0 || _ptTrans->u8StepNum > I2C_BUS_STEP_NUM) {
+        return I2C_BUS_ERROR;
+    }
+
+    _ptTrans->iResult = I2C_BUS_ERROR;
+    _ptTrans->u8Step = 0;
+    _ptTrans->u8Retry = 0;
+    _ptTrans->u64ReadyMs = Kernel::get_ms_count() + _ptTrans->tStep[0].u16DelayMs;
+    _ptTrans->u64SubmitUs = g_tBusClock.read_high_resolution_us();
+    _ptTrans->ptNext = NULL;
+
+    g_tBusMutex.lock();
+    for(pptTail = &g_ptQueue; *pptTail != NULL; pptTail = &(*pptTail)->ptNext) {
+        if(*pptTail == _ptTrans) {
+            // Already queued
+            g_tBusMutex.unlock();
+            return I2C_BUS_ERROR;
+        }
+    }
+    *pptTail = _ptTrans;
+    g_tBusMutex.unlock();
+
+    g_tBusFlags.set(I2C_BUS_FLAG_KICK);
+    return I2C_BUS_OK;
+}
+
+int i2c_bus_wait(TI2CTransaction *_ptTrans, uint32_t _u32TimeoutMs)
+{
+    if(_ptTrans->tDone.wait(_u32TimeoutMs) > 0) {
+        return _ptTrans->iResult;
+    }
+
+    //
+    // Give up unless the bus is on it right now, the driver may reuse the
+    // transaction as soon as we return
+    //
+    g_tBusMutex.lock();
+    if(_ptTrans != g_ptActive) {
+        i2c_bus_unlink(_ptTrans);
+        g_tBusMutex.unlock();
+        if(_ptTrans->tDone.wait(0) > 0) {
+            return _ptTrans->iResult;
+        }
+        return I2C_BUS_TIMEOUT;
+    }
+    g_tBusMutex.unlock();
+
+    _ptTrans->tDone.wait(osWaitForever);
+    return _ptTrans->iResult;
+}
+
+int i2c_bus_run(TI2CTransaction *_ptTrans)
+{
+    uint32_t u32TimeoutMs = 0;
+    int i, iRet;
+
+    iRet = i2c_bus_submit(_ptTrans);
+    if(iRet != I2C_BUS_OK) {
+        return iRet;
+    }
+
+    for(i = 0; i < _ptTrans->u8StepNum; i++) {
+        u32TimeoutMs += _ptTrans->tStep[i].u16DelayMs + (I2C_BUS_RETRY_CNT + 1) * I2C_BUS_XFER_TIMEOUT_MS;
+    }
+    return i2c_bus_wait(_ptTrans, u32TimeoutMs);
+}
+
+void i2c_bus_report(void)
+{
+    TI2CDevice *ptDev;
+
+    if(g_ptBackend == NULL) {
+        return;
+    }
+
+    print_function("========== I2C bus: %s, %d kHz ==========\n", g_ptBackend->strName, I2C_BUS_FREQUENCY / 1000);
+    g_tBusMutex.lock();
+    for(ptDev = g_ptDevices; ptDev != NULL; ptDev = ptDev->ptNext) {
+        print_function("%-8s 0x%02x trans:%u err:%u nack:%u last:%lu avg:%lu max:%lu us\n",
+                    ptDev->strName,
+                    ptDev->u8Addr,
+                    ptDev->uiTransCnt,
+                    ptDev->uiErrCnt,
+                    ptDev->uiNackCnt,
+                    (unsigned long)ptDev->u32LastUs,
+                    (unsigned long)(ptDev->uiTransCnt ? ptDev->u64TotalUs / ptDev->uiTransCnt : 0),
+                    (unsigned long)ptDev->u32MaxUs);
+    }
+    g_tBusMutex.unlock();
+}
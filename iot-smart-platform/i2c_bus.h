@@ -0,0 +1,82 @@
+#ifndef __I2C_BUS_H__
+#define __I2C_BUS_H__
+
+#include <mbed.h>
+
+//
+// Sensor bus manager. Drivers describe a register access as a transaction of
+// up to I2C_BUS_STEP_NUM steps and submit it; one bus thread runs the queued
+// transactions back to back. A step may ask for a delay before it runs, e.g.
+// a conversion time, and the bus serves other devices meanwhile. A NACKed
+// step is retried up to I2C_BUS_RETRY_CNT times.
+//
+#define I2C_BUS_FREQUENCY           400000
+#define I2C_BUS_RETRY_CNT           3
+#define I2C_BUS_STEP_NUM            4
+#define I2C_BUS_XFER_TIMEOUT_MS     50      // One transfer on the wire
+#define I2C_BUS_THREAD_STACK_SIZE   1024
+
+#define I2C_BUS_OK                  0
+#define I2C_BUS_ERROR               -1
+#define I2C_BUS_NACK                -2
+#define I2C_BUS_TIMEOUT             -3
+
+typedef struct _TI2CBackend {
+    const char *strName;
+    int (*pfnOpen)(int _iFrequency);
+    // 7-bit address, writes _pcTx then reads _pcRx with a repeated start, either may be empty
+    int (*pfnTransfer)(uint8_t _u8Addr, const char *_pcTx, int _iTxLen, char *_pcRx, int _iRxLen);
+} TI2CBackend;
+
+typedef struct _TI2CDevice {
+    const char *strName;
+    uint8_t u8Addr;             // 7-bit address
+    unsigned int uiTransCnt;
+    unsigned int uiErrCnt;
+    unsigned int uiNackCnt;     // Every NACK, also the retried ones
+    uint32_t u32LastUs;         // Submit to completion
+    uint32_t u32MaxUs;
+    uint64_t u64TotalUs;
+    struct _TI2CDevice *ptNext;
+} TI2CDevice;
+
+typedef struct _TI2CStep {
+    const char *pcTx;
+    uint8_t u8TxLen;
+    char *pcRx;
+    uint8_t u8RxLen;
+    uint16_t u16DelayMs;        // Wait before this step
+} TI2CStep;
+
+// Owned by the driver, must stay valid until i2c_bus_wait returns
+typedef struct _TI2CTransaction {
+    TI2CDevice *ptDev;
+    TI2CStep tStep[I2C_BUS_STEP_NUM];
+    uint8_t u8StepNum;
+    int iResult;
+
+    // Bus manager state
+    uint8_t u8Step;
+    uint8_t u8Retry;
+    uint64_t u64ReadyMs;
+    uint64_t u64SubmitUs;
+    Semaphore tDone;
+    struct _TI2CTransaction *ptNext;
+} TI2CTransaction;
+
+const TI2CBackend *i2c_backend_mbed(void);
+const TI2CBackend *i2c_backend_mock(void);
+
+// Mock devices: 16-bit big-endian registers selected by a 1-byte pointer write
+int i2c_mock_attach(uint8_t _u8Addr);
+void i2c_mock_set_reg(uint8_t _u8Addr, uint8_t _u8Reg, uint16_t _u16Value);
+void i2c_mock_inject_nack(uint8_t _u8Addr, unsigned int _uiCnt);
+
+int i2c_bus_init(const TI2CBackend *_ptBackend);
+void i2c_bus_attach(TI2CDevice *_ptDev, const char *_strName, uint8_t _u8Addr);
+int i2c_bus_submit(TI2CTransaction *_ptTrans);
+int i2c_bus_wait(TI2CTransaction *_ptTrans, uint32_t _u32TimeoutMs);
+int i2c_bus_run(TI2CTransaction *_ptTrans);
+void i2c_bus_report(void);
+
+#endif // End of __I2C_BUS_H__
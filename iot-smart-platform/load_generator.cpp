@@ -0,0 +1,320 @@
+
+#include "mbed.h"
+#include <math.h>
+#include <coap_transport.h>
+#include <debug_print.h>
+#include <smart_platform.h>
+#include <load_generator.h>
+
+static const char *g_strPhaseName[LOADGEN_PHASE_NUM] = { "get_id", "register", "write" };
+
+static TLoadGenNode *g_ptNodes = NULL;
+static TLoadGenStats g_tStats[LOADGEN_PHASE_NUM];
+static Mutex g_tStatMutex;
+static uint64_t g_u64StartMs = 0;
+static volatile int g_iStop = 0;
+static volatile unsigned int g_uiStormGen = 0;
+
+static Thread *g_ptWorker[LOADGEN_WORKER_NUM];
+static int g_iWorkerIdx[LOADGEN_WORKER_NUM];
+
+static uint32_t LoadGen_u32Now(void)
+{
+    return (uint32_t)(Kernel::get_ms_count() - g_u64StartMs);
+}
+
+// Histogram bucket of a latency, see LOADGEN_HIST_NUM
+static unsigned int LoadGen_uiBucket(uint32_t _u32LatencyMs)
+{
+    unsigned int uiBits = 0;
+    unsigned int uiIdx;
+
+    if(_u32LatencyMs < LOADGEN_HIST_LINEAR_MS) {
+        return _u32LatencyMs;
+    }
+
+    // Doublings above LOADGEN_HIST_LINEAR_MS, the next 3 bits pick the sub bucket
+    while((_u32LatencyMs >> uiBits) >= 2 * LOADGEN_HIST_SUB_NUM) {
+        uiBits++;
+    }
+    uiIdx = LOADGEN_HIST_LINEAR_MS + (uiBits - 1) * LOADGEN_HIST_SUB_NUM + ((_u32LatencyMs >> uiBits) - LOADGEN_HIST_SUB_NUM);
+    return (uiIdx < LOADGEN_HIST_NUM) ? uiIdx : LOADGEN_HIST_NUM - 1;
+}
+
+// Highest latency in a bucket
+static uint32_t LoadGen_u32BucketMs(unsigned int _uiIdx)
+{
+    unsigned int uiBits;
+
+    if(_uiIdx < LOADGEN_HIST_LINEAR_MS) {
+        return _uiIdx;
+    }
+
+    _uiIdx -= LOADGEN_HIST_LINEAR_MS;
+    uiBits = _uiIdx / LOADGEN_HIST_SUB_NUM + 1;
+    return ((uint32_t)(LOADGEN_HIST_SUB_NUM + _uiIdx % LOADGEN_HIST_SUB_NUM + 1) << uiBits) - 1;
+}
+
+// Latency below which the given percentage of the samples lies, capped by the exact max
+static uint32_t LoadGen_u32Percentile(const TLoadGenStats *_ptStats, unsigned int _uiPct)
+{
+    unsigned int i, uiSum = 0;
+    unsigned int uiRank = _ptStats->uiOkCnt * _uiPct / 100;
+    uint32_t u32Ms;
+
+    for(i = 0; i < LOADGEN_HIST_NUM; i++) {
+        uiSum += _ptStats->uiHist[i];
+        if(uiSum > uiRank) {
+            // The last bucket has no upper bound
+            u32Ms = (i < LOADGEN_HIST_NUM - 1) ? LoadGen_u32BucketMs(i) : _ptStats->u32MaxMs;
+            return (u32Ms < _ptStats->u32MaxMs) ? u32Ms : _ptStats->u32MaxMs;
+        }
+    }
+    return 0;
+}
+
+static void LoadGen_vRecord(int _iPhase, int _iRet, uint32_t _u32LatencyMs)
+{
+    TLoadGenStats *ptStats = &g_tStats[_iPhase];
+
+    g_tStatMutex.lock();
+    if(_iRet == 0) {
+        ptStats->uiOkCnt++;
+        ptStats->uiHist[LoadGen_uiBucket(_u32LatencyMs)]++;
+        if(_u32LatencyMs > ptStats->u32MaxMs) {
+            ptStats->u32MaxMs = _u32LatencyMs;
+        }
+    }
+    else {
+        ptStats->uiFailCnt++;
+    }
+    g_tStatMutex.unlock();
+}
+
+// Put a node back to power-on, it starts within LOADGEN_BOOT_SPREAD_SEC
+static void LoadGen_vBoot(TLoadGenNode *_ptNode, uint32_t _u32NowMs)
+{
+    memset(_ptNode->strDeviceId, 0, sizeof(_ptNode->strDeviceId));
+    _ptNode->u8Phase = LOADGEN_PHASE_GET_ID;
+    _ptNode->u8Retry = 0;
+    _ptNode->u8Registered = 0;
+    _ptNode->u32NextMs = _u32NowMs;
+#if LOADGEN_BOOT_SPREAD_SEC > 0
+    _ptNode->u32NextMs += rand() % (LOADGEN_BOOT_SPREAD_SEC * 1000);
+#endif
+}
+
+// Slowly varying readings in the HDC1050 range, every node with its own phase
+static void LoadGen_vSensor(unsigned int _uiIdx, uint32_t _u32NowMs, float *_pfTemperature, uint16_t *_pu16Humidity)
+{
+    float fAngle = 2 * 3.14159f * (_u32NowMs / 3600000.0f) + _uiIdx;
+    float fHumidity;
+
+    *_pfTemperature = 25.0f + 3.0f * sinf(fAngle) + (rand() % 41 - 20) / 100.0f;
+    fHumidity = 55.0f + 10.0f * cosf(fAngle) + (rand() % 3 - 1);
+    *_pu16Humidity = (uint16_t)fHumidity;
+}
+
+// One step of the main.cpp life cycle
+static void LoadGen_vStep(TLoadGenNode *_ptNode, unsigned int _uiIdx)
+{
+    char cSN[SPLAT_SN_LEN];
+    TSPlatReading tBatch[LOADGEN_BATCH_NUM];
+    uint64_t u64StartMs;
+    unsigned int i;
+    uint32_t u32NowMs;
+    int iRet;
+
+    snprintf(cSN, SPLAT_SN_LEN, LOADGEN_SN_FORMAT, DEVICE_SN, _uiIdx);
+    u64StartMs = Kernel::get_ms_count();
+
+    switch(_ptNode->u8Phase) {
+    case LOADGEN_PHASE_GET_ID:
+        // Every node has a cache of its own, a lookup answered from ours would
+        // measure nothing and spare the cloud the load of a reboot
+        SPlat_vCacheFlush();
+        memset(_ptNode->strDeviceId, 0, sizeof(_ptNode->strDeviceId));
+        iRet = SPlat_iGetDeviceId(DEVICE_DIGEST, cSN, _ptNode->strDeviceId);
+        break;
+    case LOADGEN_PHASE_REGISTER:
+        iRet = SPlat_iRegister(DEVICE_DIGEST, cSN);
+        break;
+    default:
+        for(i = 0; i < LOADGEN_BATCH_NUM; i++) {
+            LoadGen_vSensor(_uiIdx, (uint32_t)(u64StartMs - g_u64StartMs), &tBatch[i].fTemperature, &tBatch[i].u16Humidity);
+            tBatch[i].u64LocalMs = u64StartMs;
+        }
+        // A node catching up on stored readings, as in the uplink queue
+        if(LOADGEN_BATCH_NUM > 1) {
+            iRet = SPlat_iWriteSensorBatch(_ptNode->strDeviceId, tBatch, LOADGEN_BATCH_NUM);
+        }
+        else {
+            iRet = SPlat_iWriteSensorData(_ptNode->strDeviceId, tBatch[0].fTemperature, tBatch[0].u16Humidity);
+        }
+        break;
+    }
+
+    LoadGen_vRecord(_ptNode->u8Phase, iRet, (uint32_t)(Kernel::get_ms_count() - u64StartMs));
+    u32NowMs = LoadGen_u32Now();
+
+    if(_ptNode->u8Phase == LOADGEN_PHASE_WRITE) {
+        // Keep the cadence, unless we are already late
+        _ptNode->u32NextMs += LOADGEN_PERIOD_SEC * 1000;
+        if(_ptNode->u32NextMs < u32NowMs) {
+            _ptNode->u32NextMs = u32NowMs;
+        }
+        return;
+    }
+
+    _ptNode->u32NextMs = u32NowMs + LOADGEN_PERIOD_SEC * 1000;
+    if(iRet == 0) {
+        _ptNode->u8Retry = 0;
+        if(_ptNode->u8Phase == LOADGEN_PHASE_GET_ID) {
+            _ptNode->u8Phase = LOADGEN_PHASE_WRITE;
+            _ptNode->u32NextMs = u32NowMs;
+        }
+        else {
+            _ptNode->u8Registered = 1;
+            _ptNode->u8Phase = LOADGEN_PHASE_GET_ID;
+        }
+        return;
+    }
+
+    if(++_ptNode->u8Retry < LOADGEN_RETRY_CNT) {
+        return;
+    }
+
+    // Out of retries, register when the cloud does not know us, otherwise start over like a rebooted node
+    _ptNode->u8Retry = 0;
+    if(_ptNode->u8Phase == LOADGEN_PHASE_GET_ID && !_ptNode->u8Registered) {
+        _ptNode->u8Phase = LOADGEN_PHASE_REGISTER;
+    }
+    else {
+        LoadGen_vBoot(_ptNode, _ptNode->u32NextMs);
+    }
+}
+
+static void LoadGen_vWorker(int *_piIdx)
+{
+    unsigned int i, uiNext, uiGen = g_uiStormGen;
+    uint32_t u32NowMs;
+
+    while(!g_iStop) {
+        u32NowMs = LoadGen_u32Now();
+
+        // Boot storm, every node of the fleet restarts
+        if(uiGen != g_uiStormGen) {
+            uiGen = g_uiStormGen;
+            for(i = *_piIdx; i < LOADGEN_NODE_NUM; i += LOADGEN_WORKER_NUM) {
+                LoadGen_vBoot(&g_ptNodes[i], u32NowMs);
+            }
+        }
+
+        uiNext = *_piIdx;
+        for(i = *_piIdx; i < LOADGEN_NODE_NUM; i += LOADGEN_WORKER_NUM) {
+            if(g_ptNodes[i].u32NextMs < g_ptNodes[uiNext].u32NextMs) {
+                uiNext = i;
+            }
+        }
+
+        if(g_ptNodes[uiNext].u32NextMs > u32NowMs) {
+            ThisThread::sleep_for(g_ptNodes[uiNext].u32NextMs - u32NowMs > 1000 ? 1000 : g_ptNodes[uiNext].u32NextMs - u32NowMs);
+            continue;
+        }
+        LoadGen_vStep(&g_ptNodes[uiNext], uiNext);
+    }
+}
+
+void LoadGen_vReport(void)
+{
+    TLoadGenStats tStats;
+    unsigned int i, uiTotal = 0, uiActive = 0, uiTxDrop = 0, uiRxDrop = 0;
+    uint32_t u32ElapsedMs = LoadGen_u32Now();
+    int iPhase;
+
+    print_function("========== Load: %d nodes, %lu s ==========\n", LOADGEN_NODE_NUM, (unsigned long)(u32ElapsedMs / 1000));
+    for(iPhase = 0; iPhase < LOADGEN_PHASE_NUM; iPhase++) {
+        // Workers keep recording, so take the counters and the histogram together
+        g_tStatMutex.lock();
+        tStats = g_tStats[iPhase];
+        g_tStatMutex.unlock();
+
+        uiTotal += tStats.uiOkCnt;
+        print_function("%-8s ok:%u fail:%u err:%.1f%% p50:%lu p90:%lu p99:%lu max:%lu ms\n",
+                    g_strPhaseName[iPhase],
+                    tStats.uiOkCnt,
+                    tStats.uiFailCnt,
+                    (tStats.uiOkCnt + tStats.uiFailCnt) ? 100.0f * tStats.uiFailCnt / (tStats.uiOkCnt + tStats.uiFailCnt) : 0.0f,
+                    (unsigned long)LoadGen_u32Percentile(&tStats, 50),
+                    (unsigned long)LoadGen_u32Percentile(&tStats, 90),
+                    (unsigned long)LoadGen_u32Percentile(&tStats, 99),
+                    (unsigned long)tStats.u32MaxMs);
+    }
+
+    for(i = 0; i < LOADGEN_NODE_NUM; i++) {
+        if(g_ptNodes[i].u8Phase == LOADGEN_PHASE_WRITE) {
+            uiActive++;
+        }
+    }
+    coap_impair_get_stats(&uiTxDrop, &uiRxDrop);
+    print_function("Nodes uploading:%u, throughput:%.2f req/s, dropped tx:%u rx:%u\n",
+                uiActive,
+                u32ElapsedMs ? uiTotal * 1000.0f / u32ElapsedMs : 0.0f,
+                uiTxDrop,
+                uiRxDrop);
+    // Bytes and goodput per transport, run once with COAP_TCP_BULK 0 and once with 1 to compare
+    coap_path_report();
+}
+
+int LoadGen_iRun(void)
+{
+    uint32_t u32LastReportMs = 0, u32LastStormMs = 0, u32NowMs;
+    int i;
+
+    g_ptNodes = (TLoadGenNode *)calloc(LOADGEN_NODE_NUM, sizeof(TLoadGenNode));
+    if(g_ptNodes == NULL) {
+        print_function("Not enough memory for %d nodes!\n", LOADGEN_NODE_NUM);
+        return -1;
+    }
+    memset(g_tStats, 0, sizeof(g_tStats));
+    srand((unsigned int)Kernel::get_ms_count());
+
+    g_u64StartMs = Kernel::get_ms_count();
+    for(i = 0; i < LOADGEN_NODE_NUM; i++) {
+        LoadGen_vBoot(&g_ptNodes[i], 0);
+    }
+
+    print_function("Load generator: %d nodes, %d workers, period %d s, %d readings per upload\n",
+                LOADGEN_NODE_NUM, LOADGEN_WORKER_NUM, LOADGEN_PERIOD_SEC, LOADGEN_BATCH_NUM);
+    for(i = 0; i < LOADGEN_WORKER_NUM; i++) {
+        g_iWorkerIdx[i] = i;
+        g_ptWorker[i] = new Thread(osPriorityNormal, LOADGEN_WORKER_STACK_SIZE);
+        g_ptWorker[i]->start(callback(LoadGen_vWorker, &g_iWorkerIdx[i]));
+    }
+
+    while(LOADGEN_DURATION_SEC == 0 || LoadGen_u32Now() < LOADGEN_DURATION_SEC * 1000UL) {
+        ThisThread::sleep_for(1000);
+        u32NowMs = LoadGen_u32Now();
+
+        if(LOADGEN_STORM_SEC > 0 && u32NowMs - u32LastStormMs >= LOADGEN_STORM_SEC * 1000UL) {
+            print_function("Boot storm, all nodes restart\n");
+            u32LastStormMs = u32NowMs;
+            g_uiStormGen++;
+        }
+        if(u32NowMs - u32LastReportMs >= LOADGEN_REPORT_SEC * 1000UL) {
+            u32LastReportMs = u32NowMs;
+            LoadGen_vReport();
+        }
+    }
+
+    g_iStop = 1;
+    for(i = 0; i < LOADGEN_WORKER_NUM; i++) {
+        g_ptWorker[i]->join();
+        delete g_ptWorker[i];
+    }
+    LoadGen_vReport();
+
+    free(g_ptNodes);
+    g_ptNodes = NULL;
+    return 0;
+}
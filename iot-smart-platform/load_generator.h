@@ -0,0 +1,78 @@
+#ifndef __LOAD_GENERATOR_H__
+#define __LOAD_GENERATOR_H__
+
+#include <mbed.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//
+// Fleet load generator, enabled with SPLAT_LOADGEN=1. Each virtual node runs
+// the life cycle of main.cpp: get device ID, register when unknown, then
+// upload synthetic HDC1050 readings every LOADGEN_PERIOD_SEC. The settings
+// below can be overridden from the macros of mbed_app.json.
+//
+#ifndef LOADGEN_NODE_NUM
+#define LOADGEN_NODE_NUM            100
+#endif
+#ifndef LOADGEN_WORKER_NUM
+#define LOADGEN_WORKER_NUM          4       // Requests in flight, below COAP_TRANSACTION_NUM
+#endif
+#ifndef LOADGEN_PERIOD_SEC
+#define LOADGEN_PERIOD_SEC          10
+#endif
+#ifndef LOADGEN_BOOT_SPREAD_SEC
+#define LOADGEN_BOOT_SPREAD_SEC     0       // 0 boots every node at once
+#endif
+#ifndef LOADGEN_STORM_SEC
+#define LOADGEN_STORM_SEC           0       // Reboot the whole fleet this often, 0 never
+#endif
+#ifndef LOADGEN_BATCH_NUM
+#define LOADGEN_BATCH_NUM           1       // Readings per upload, above 1 they go as bulk uploads
+#endif
+#ifndef LOADGEN_DURATION_SEC
+#define LOADGEN_DURATION_SEC        600     // 0 runs forever
+#endif
+
+#define LOADGEN_WORKER_STACK_SIZE   3072
+#define LOADGEN_REPORT_SEC          60
+#define LOADGEN_RETRY_CNT           3
+// Latency histogram over the whole run, one bucket per ms below
+// LOADGEN_HIST_LINEAR_MS, then LOADGEN_HIST_SUB_NUM per doubling so the
+// percentiles are within 12.5%. Beyond about 262 s all fall into the last.
+#define LOADGEN_HIST_SUB_NUM        8
+#define LOADGEN_HIST_LINEAR_MS      (2 * LOADGEN_HIST_SUB_NUM)
+#define LOADGEN_HIST_OCTAVE_NUM     14
+#define LOADGEN_HIST_NUM            (LOADGEN_HIST_LINEAR_MS + LOADGEN_HIST_OCTAVE_NUM * LOADGEN_HIST_SUB_NUM)
+#define LOADGEN_SN_FORMAT           "%s-%05u"
+
+#define LOADGEN_PHASE_GET_ID        0
+#define LOADGEN_PHASE_REGISTER      1
+#define LOADGEN_PHASE_WRITE         2
+#define LOADGEN_PHASE_NUM           3
+
+typedef struct _TLoadGenNode{
+    char strDeviceId[16];
+    uint8_t u8Phase;
+    uint8_t u8Retry;
+    uint8_t u8Registered;
+    uint32_t u32NextMs;         // Relative to the start of the run
+}TLoadGenNode;
+
+typedef struct _TLoadGenStats{
+    unsigned int uiOkCnt;
+    unsigned int uiFailCnt;
+    uint32_t u32MaxMs;
+    unsigned int uiHist[LOADGEN_HIST_NUM];
+}TLoadGenStats;
+
+int LoadGen_iRun(void);
+void LoadGen_vReport(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // End of __LOAD_GENERATOR_H__
@@ -3,43 +3,91 @@
 #include <coap_api.h>
 #include <debug_print.h>
 #include <smart_platform.h>
-#include <string>
+#include <time_sync.h>
 
-static char g_cUriBuf[URI_BUF_SIZE];
-static char g_cJsonBuf[JSON_BUF_SIZE];
+// Request buffers are on the caller's stack so the SPlat_i* calls can run from several threads,
+// except for the batch buffer used by the gateway flush, held with g_tBatchMutex
+static char g_cBatchBuf[BATCH_JSON_BUF_SIZE];
+static Mutex g_tBatchMutex;
 static uint8_t g_u8RecvBuf[RECV_BUF_SIZE];
 
+// Devices attached with SPlat_iDeviceOpen. The lock covers the list and the
+// batches in it but is never held over the network, uploads work on devices
+// claimed with SPlat_iDeviceClaim
+static TSPlatDevice *g_ptDeviceList = NULL;
+static Mutex g_tDeviceMutex;
+static unsigned int g_uiGatewayRound = 0;
+
+// Priority uplink, see SPlat_iUplinkStart
+static char g_strUplinkDeviceId[SPLAT_DEVICE_ID_LEN];
+static char g_cUplinkBuf[SPLAT_BULK_JSON_BUF_SIZE];
+static TSPlatReading g_tUplinkQueue[SPLAT_UPLINK_QUEUE_NUM];
+static unsigned int g_uiUplinkHead = 0;     // Sequence number of the oldest queued reading
+static unsigned int g_uiUplinkTail = 0;     // Sequence number of the next reading
+static volatile int g_iUplinkAlarmCnt = 0;  // Alarms in flight
+static TSPlatClassStats g_tUplinkStats[SPLAT_CLASS_NUM];
+static Mutex g_tUplinkMutex;
+static EventFlags g_tUplinkFlags;
+static Thread *g_ptUplinkThread = NULL;
+
+// GET responses kept per Max-Age and revalidated with their ETag
+static TSPlatCacheEntry g_tCache[SPLAT_CACHE_NUM];
+static Mutex g_tCacheMutex;
+static unsigned int g_uiCacheHitCnt = 0;
+static unsigned int g_uiCacheValidCnt = 0;
+static unsigned int g_uiCacheMissCnt = 0;
+static unsigned int g_uiCacheSavedBytes = 0;
+
+// Server time for reading timestamps, see SPlat_iTimeSync
+static TTimeSync g_tTimeSync;
+static Mutex g_tTimeMutex;
+static uint64_t g_u64TimeTryMs = 0;         // Last attempt, failed ones are not repeated at once
+
 int SPlat_iInit(void)
 {
+    TimeSync_vInit(&g_tTimeSync);
     return coap_init(g_u8RecvBuf);   
 }
 
 int SPlat_iRegister(const char *_strDigest, const char *_strSN)
 {
-    int iRet;
+    int iRet, iTrans;
     unsigned int uiSize;
     TRecvResponse tResponse;
+    char cUriBuf[URI_BUF_SIZE];
+    char cJsonBuf[JSON_BUF_SIZE];
     
-    memset(g_cJsonBuf, 0, JSON_BUF_SIZE); 
-    uiSize = snprintf(g_cJsonBuf, JSON_BUF_SIZE, JSON_CMD_REGISTER, _strDigest);
+    memset(cJsonBuf, 0, JSON_BUF_SIZE); 
+    uiSize = snprintf(cJsonBuf, JSON_BUF_SIZE, JSON_CMD_REGISTER, _strDigest);
     if(uiSize >= JSON_BUF_SIZE) {
         print_function("Maybe buffer size of json too small!\n\r");
         return -1;
     }
 
-    memset(g_cUriBuf, 0, URI_BUF_SIZE);
-    uiSize = snprintf(g_cUriBuf, URI_BUF_SIZE, RESTFUL_API_REGISTER, API_KEY, _strSN);
+    memset(cUriBuf, 0, URI_BUF_SIZE);
+    uiSize = snprintf(cUriBuf, URI_BUF_SIZE, RESTFUL_API_REGISTER, API_KEY, _strSN);
     if(uiSize >= URI_BUF_SIZE) {
         print_function("Maybe buffer size of URI too small!\n\r");
         return -1;
     }
     
-    coap_post(g_cUriBuf, g_cJsonBuf);
+    // The request is built before coap_post returns, so the JSON buffer can take the response
+    iTrans = coap_post(cUriBuf, cJsonBuf, (uint8_t *)cJsonBuf, JSON_BUF_SIZE);
 
-    memset(g_cJsonBuf, 0, JSON_BUF_SIZE);
     tResponse.u16PayloadLen = JSON_BUF_SIZE;
-    tResponse.pu8Payload = (uint8_t *)g_cJsonBuf;
-    iRet = SPlat_iRecvResponse(&tResponse);
+    tResponse.pu8Payload = (uint8_t *)cJsonBuf;
+    iRet = SPlat_iRecvResponse(iTrans, &tResponse);
+
+    //
+    // A device list cached before the registration would hide the new device
+    // from SPlat_iGetDeviceId until it expires. Dropped even when no answer came, the server may have
+    // registered it anyway.
+    //
+    uiSize = snprintf(cUriBuf, URI_BUF_SIZE, RESTFUL_API_GET_ALL_THINGS, API_KEY, _strSN, _strDigest);
+    if(uiSize < URI_BUF_SIZE) {
+        SPlat_vCacheDrop(cUriBuf);
+    }
+
     if(iRet != 0 || tResponse.u16MsgCode != 69) {
         return -1;
     }
@@ -47,6 +95,167 @@ int SPlat_iRegister(const char *_strDigest, const char *_strSN)
     return 0;
 }
 
+static TSPlatCacheEntry *SPlat_ptCacheFind(const char *_strUri)
+{
+    int i;
+
+    for(i = 0; i < SPLAT_CACHE_NUM; i++) {
+        if(g_tCache[i].strUri[0] != '\0' && strcmp(g_tCache[i].strUri, _strUri) == 0) {
+            return &g_tCache[i];
+        }
+    }
+    return NULL;
+}
+
+static void SPlat_vCacheStore(const char *_strUri, const TRecvResponse *_ptResponse, uint64_t _u64NowMs)
+{
+    TSPlatCacheEntry *ptEntry = SPlat_ptCacheFind(_strUri);
+    int i;
+
+    // Nothing to reuse or too big to keep, drop what we had
+    if((_ptResponse->u32MaxAge == 0 && _ptResponse->u8ETagLen == 0)
+        || _ptResponse->u16PayloadLen >= SPLAT_CACHE_PAYLOAD_SIZE
+        || strlen(_strUri) >= URI_BUF_SIZE) {
+        if(ptEntry != NULL) {
+            ptEntry->strUri[0] = '\0';
+        }
+        return;
+    }
+
+    // Otherwise replace the least recently used entry
+    if(ptEntry == NULL) {
+        ptEntry = &g_tCache[0];
+        for(i = 1; i < SPLAT_CACHE_NUM && ptEntry->strUri[0] != '\0'; i++) {
+            if(g_tCache[i].strUri[0] == '\0' || g_tCache[i].u64UsedMs < ptEntry->u64UsedMs) {
+                ptEntry = &g_tCache[i];
+            }
+        }
+        strcpy(ptEntry->strUri, _strUri);
+    }
+
+    ptEntry->u64ExpireMs = _u64NowMs + _ptResponse->u32MaxAge * 1000ULL;
+    ptEntry->u64UsedMs = _u64NowMs;
+    ptEntry->u8ETagLen = _ptResponse->u8ETagLen;
+    memcpy(ptEntry->u8ETag, _ptResponse->u8ETag, _ptResponse->u8ETagLen);
+    ptEntry->u16PayloadLen = _ptResponse->u16PayloadLen;
+    memcpy(ptEntry->cPayload, _ptResponse->pu8Payload, _ptResponse->u16PayloadLen);
+    ptEntry->cPayload[ptEntry->u16PayloadLen] = '\0';
+}
+
+//
+// GET through the response cache. A fresh entry is answered locally, a stale
+// one with an ETag is revalidated and a 2.03 Valid answer refreshes it
+// without a payload. The caller sees 2.05 Content either way.
+//
+static int SPlat_iCachedGet(const char *_strUri, char *_strResp, uint16_t _u16Size, TRecvResponse *_ptResponse)
+{
+    TSPlatCacheEntry *ptEntry;
+    uint8_t u8ETag[COAP_ETAG_MAX_LEN];
+    uint8_t u8ETagLen = 0;
+    uint64_t u64NowMs = Kernel::get_ms_count();
+    int iTrans, iRet = 0;
+
+    g_tCacheMutex.lock();
+    ptEntry = SPlat_ptCacheFind(_strUri);
+    if(ptEntry != NULL && ptEntry->u16PayloadLen < _u16Size) {
+        if(u64NowMs < ptEntry->u64ExpireMs) {
+            memcpy(_strResp, ptEntry->cPayload, ptEntry->u16PayloadLen + 1);
+            _ptResponse->u16MsgCode = COAP_MSG_CODE_RESPONSE_CONTENT;
+            _ptResponse->u16PayloadLen = ptEntry->u16PayloadLen;
+            ptEntry->u64UsedMs = u64NowMs;
+            g_uiCacheHitCnt++;
+#if SPLAT_DEBUG
+            print_function("Cache hit, fresh for %lu ms\n", (unsigned long)(ptEntry->u64ExpireMs - u64NowMs));
+#endif // SPLAT_DEBUG
+            g_tCacheMutex.unlock();
+            return 0;
+        }
+        u8ETagLen = ptEntry->u8ETagLen;
+        memcpy(u8ETag, ptEntry->u8ETag, u8ETagLen);
+    }
+    g_tCacheMutex.unlock();
+
+    iTrans = coap_get_etag(_strUri, u8ETag, u8ETagLen, (uint8_t *)_strResp, _u16Size);
+    _ptResponse->u16PayloadLen = _u16Size;
+    _ptResponse->pu8Payload = (uint8_t *)_strResp;
+    if(SPlat_iRecvResponse(iTrans, _ptResponse) != 0) {
+        return -1;
+    }
+
+    u64NowMs = Kernel::get_ms_count();
+    g_tCacheMutex.lock();
+    if(_ptResponse->u16MsgCode == COAP_MSG_CODE_RESPONSE_VALID) {
+        // Our copy is still current, unless it was evicted meanwhile
+        ptEntry = SPlat_ptCacheFind(_strUri);
+        if(ptEntry != NULL && ptEntry->u16PayloadLen < _u16Size) {
+            memcpy(_strResp, ptEntry->cPayload, ptEntry->u16PayloadLen + 1);
+            _ptResponse->u16MsgCode = COAP_MSG_CODE_RESPONSE_CONTENT;
+            _ptResponse->u16PayloadLen = ptEntry->u16PayloadLen;
+            ptEntry->u64ExpireMs = u64NowMs + _ptResponse->u32MaxAge * 1000ULL;
+            ptEntry->u64UsedMs = u64NowMs;
+            g_uiCacheValidCnt++;
+            g_uiCacheSavedBytes += ptEntry->u16PayloadLen;
+        }
+        else {
+            print_function("Validated response not in cache!\n");
+            iRet = -1;
+        }
+    }
+    else if(_ptResponse->u16MsgCode == COAP_MSG_CODE_RESPONSE_CONTENT) {
+        g_uiCacheMissCnt++;
+        SPlat_vCacheStore(_strUri, _ptResponse, u64NowMs);
+    }
+    g_tCacheMutex.unlock();
+
+    return iRet;
+}
+
+// Forget one URI, after a request that changes what it returns
+void SPlat_vCacheDrop(const char *_strUri)
+{
+    TSPlatCacheEntry *ptEntry;
+
+    g_tCacheMutex.lock();
+    ptEntry = SPlat_ptCacheFind(_strUri);
+    if(ptEntry != NULL) {
+        ptEntry->strUri[0] = '\0';
+    }
+    g_tCacheMutex.unlock();
+}
+
+// Forget the sensor readings of a device after a rawdata write changed them
+static void SPlat_vCacheDropWritten(const char *_strDeviceId)
+{
+    static const char *strSensor[] = { ID_STRING_TEMPERATURE, ID_STRING_HUMIDITY };
+    char cUriBuf[URI_BUF_SIZE];
+    unsigned int i, uiSize;
+
+    for(i = 0; i < sizeof(strSensor) / sizeof(strSensor[0]); i++) {
+        uiSize = snprintf(cUriBuf, URI_BUF_SIZE, RESTFUL_API_GET_SENSOR_DATA, API_KEY, _strDeviceId, strSensor[i]);
+        if(uiSize < URI_BUF_SIZE) {
+            SPlat_vCacheDrop(cUriBuf);
+        }
+    }
+}
+
+void SPlat_vCacheFlush(void)
+{
+    g_tCacheMutex.lock();
+    memset(g_tCache, 0, sizeof(g_tCache));
+    g_tCacheMutex.unlock();
+}
+
+void SPlat_vCacheReport(void)
+{
+    g_tCacheMutex.lock();
+    print_function("Cache hit:%u valid:%u miss:%u, saved %u payload bytes\n",
+                g_uiCacheHitCnt,
+                g_uiCacheValidCnt,
+                g_uiCacheMissCnt,
+                g_uiCacheSavedBytes);
+    g_tCacheMutex.unlock();
+}
+
 int SPlat_iGetDeviceId(const char *_strDigest, const char *_strSN, char *_strDeviceId)
 {
     int iRet;
@@ -54,12 +263,14 @@ int SPlat_iGetDeviceId(const char *_strDigest, const char *_strSN, char *_strDev
     TRecvResponse tResponse;
     char *pcChar;
     char *pcTmp1;
+    char cUriBuf[URI_BUF_SIZE];
+    char cJsonBuf[JSON_BUF_SIZE];
 
     memset(&tResponse, 0, sizeof(TRecvResponse));
-    memset(g_cJsonBuf, 0, JSON_BUF_SIZE);
-    memset(g_cUriBuf, 0, URI_BUF_SIZE);
+    memset(cJsonBuf, 0, JSON_BUF_SIZE);
+    memset(cUriBuf, 0, URI_BUF_SIZE);
 
-    uiSize = snprintf(g_cUriBuf, 
+    uiSize = snprintf(cUriBuf, 
                         URI_BUF_SIZE, 
                         RESTFUL_API_GET_ALL_THINGS, 
                         API_KEY, 
@@ -70,11 +281,7 @@ int SPlat_iGetDeviceId(const char *_strDigest, const char *_strSN, char *_strDev
         return -1;
     }
     
-    coap_get(g_cUriBuf);
-
-    tResponse.u16PayloadLen = JSON_BUF_SIZE;
-    tResponse.pu8Payload = (uint8_t *)g_cJsonBuf;
-    iRet = SPlat_iRecvResponse(&tResponse);
+    iRet = SPlat_iCachedGet(cUriBuf, cJsonBuf, JSON_BUF_SIZE, &tResponse);
     if(iRet != 0 || tResponse.u16MsgCode != 69) {
         print_function("Response failed!\n");
         return -1;
@@ -82,11 +289,11 @@ int SPlat_iGetDeviceId(const char *_strDigest, const char *_strSN, char *_strDev
 #if SPLAT_RAW_DEBUG
     else {
         print_function("Response success and payload as below\n");
-        print_function("%s\n", g_cJsonBuf);
+        print_function("%s\n", cJsonBuf);
     }
 #endif
 
-    pcChar = strstr(g_cJsonBuf, "deviceId");
+    pcChar = strstr(cJsonBuf, "deviceId");
     if(pcChar != NULL) {
         pcTmp1 = strpbrk(pcChar+11, "\"");
         //print_function("Device ID length: %d\n\r", pcTmp1 - (pcChar+11));
@@ -98,13 +305,44 @@ int SPlat_iGetDeviceId(const char *_strDigest, const char *_strSN, char *_strDev
     return -1;
 }
 
+// Post a rawdata JSON array for the device, returns the transaction or -1.
+// _iKind is one of SPLAT_POST_*. Batches go as bulk uploads, over TCP when
+// COAP_TCP_BULK is set, and alarms may use the reserved NSTART slot.
+static int SPlat_iPostRawData(const char *_strDeviceId, const char *_strJson, int _iKind)
+{
+    unsigned int uiSize;
+    char cUriBuf[URI_BUF_SIZE];
+
+    memset(cUriBuf, 0, URI_BUF_SIZE);
+    uiSize = snprintf(cUriBuf,
+                        URI_BUF_SIZE,
+                        RESTFUL_API_WRITE_SENSRO_DATA,
+                        API_KEY,
+                        _strDeviceId);
+    if(uiSize >= URI_BUF_SIZE) {
+        print_function("Maybe buffer size of URI too small!\n\r");
+        return -1;
+    }
+
+    // Only the response code matters for rawdata
+    if(_iKind == SPLAT_POST_BULK) {
+        return coap_post_bulk(cUriBuf, _strJson, NULL, 0);
+    }
+    if(_iKind == SPLAT_POST_ALARM) {
+        return coap_post_alarm(cUriBuf, _strJson, NULL, 0);
+    }
+    return coap_post(cUriBuf, _strJson, NULL, 0);
+}
+
 int SPlat_iWriteSensorData(char *_strDeviceId, float _fTempData, uint16_t _u16HumiData)
 {
     unsigned int uiSize;
+    int iTrans;
     TRecvResponse tResponse;
+    char cJsonBuf[JSON_BUF_SIZE];
     
-    memset(g_cJsonBuf, 0, JSON_BUF_SIZE); 
-    uiSize = snprintf(g_cJsonBuf, 
+    memset(cJsonBuf, 0, JSON_BUF_SIZE); 
+    uiSize = snprintf(cJsonBuf, 
                         JSON_BUF_SIZE, 
                         JSON_CMD_WRITE_SENSRO_DATA, 
                         ID_STRING_TEMPERATURE,
@@ -116,102 +354,76 @@ int SPlat_iWriteSensorData(char *_strDeviceId, float _fTempData, uint16_t _u16Hu
         return -1;
     }
 
-    memset(g_cUriBuf, 0, URI_BUF_SIZE);
-    uiSize = snprintf(g_cUriBuf, 
-                        URI_BUF_SIZE, 
-                        RESTFUL_API_WRITE_SENSRO_DATA, 
-                        API_KEY, 
-                        _strDeviceId);
-    if(uiSize >= URI_BUF_SIZE) {
-        print_function("Maybe buffer size of URI too small!\n\r");
+    iTrans = SPlat_iPostRawData(_strDeviceId, cJsonBuf, SPLAT_POST_SINGLE);
+    
+    tResponse.u16PayloadLen = 0;
+    tResponse.pu8Payload = NULL;
+    if(SPlat_iRecvResponse(iTrans, &tResponse) != 0) {
         return -1;
     }
-    
-    coap_post(g_cUriBuf, g_cJsonBuf);
-
-    memset(g_cJsonBuf, 0, JSON_BUF_SIZE);
-    tResponse.u16PayloadLen = JSON_BUF_SIZE;
-    tResponse.pu8Payload = (uint8_t *)g_cJsonBuf;
-    SPlat_iRecvResponse(&tResponse);
 
-    return 0;   
+    SPlat_vCacheDropWritten(_strDeviceId);
+    return 0;
 }
 
-int SPlat_iRecvResponse(TRecvResponse *_ptResponse)
+int SPlat_iRecvResponse(int _iTrans, TRecvResponse *_ptResponse)
 {
-    uint16_t u16Len;
-    unsigned int uiRecvCnt, uiTimeoutCnt;
+    TCoapTransaction tResult;
 
-    uiTimeoutCnt = 0;
-    while(1) {
-        coap_get_recvcnt(&u16Len, &uiRecvCnt);
-        if(uiRecvCnt > 0) {
-            print_function("Recv packet cnt:%d, len:%d\n", uiRecvCnt, u16Len);
-            coap_dec_recvcnt();
-            break;
-        }
-
-        wait(1);
-        uiTimeoutCnt++;
-        if(uiTimeoutCnt >= TIMEOUT_SEC) {
-            print_function("Timeout and no response from cloud!\n");
-            return -1;
-        }
+    if(_iTrans < 0) {
+        print_function("Send request failed!\n");
+        return -1;
     }
 
-#if SPLAT_RAW_DEBUG
-    print_function("Received a message of length '%d'\n", u16Len);
-    for (size_t ix = 0; ix < u16Len; ix++) {
-        print_function("%02x ", g_u8RecvBuf[ix]);
-       }
-    print_function("\n\r");
-#endif // SPLAT_DEBUG
-
-    sn_coap_hdr_s* parsed = coap_get_parser_obj(g_u8RecvBuf, u16Len);
-
-    // We know the payload is going to be a string
-    std::string payload((const char*)parsed->payload_ptr, parsed->payload_len);
+    if(coap_wait_response(_iTrans, TIMEOUT_SEC * 1000, &tResult) != 0) {
+        print_function("Timeout and no response from cloud!\n");
+        return -1;
+    }
 
 #if SPLAT_DEBUG
     print_function("Response >>>>>>>>>>>>\n\r");
-    print_function("\tmsg_id:           %d\n\r", parsed->msg_id);
-    print_function("\tmsg_code:         %d\n\r", parsed->msg_code);
-    print_function("\tcontent_format:   %d\n\r", parsed->content_format);
-    print_function("\tpayload_len:      %d\n\r", parsed->payload_len);
-    print_function("\tpayload:          %s\n\r", payload.c_str());
-    print_function("\toptions_list_ptr: %p\n\r", parsed->options_list_ptr);
+    print_function("\tmsg_id:           %d\n\r", tResult.u16MsgId);
+    print_function("\tmsg_code:         %d\n\r", tResult.u16MsgCode);
+    print_function("\trtt:              %d ms\n\r", tResult.u32RttMs);
+    print_function("\tpayload_len:      %d\n\r", tResult.u16PayloadLen);
+    if(tResult.pu8Payload != NULL) {
+        print_function("\tpayload:          %s\n\r", (const char *)tResult.pu8Payload);
+    }
 #endif // SPLAT_DEBUG
 
+    _ptResponse->u16MsgId = tResult.u16MsgId;
+    _ptResponse->u16MsgCode = tResult.u16MsgCode;
+    _ptResponse->u32MaxAge = tResult.u32MaxAge;
+    _ptResponse->u8ETagLen = tResult.u8ETagLen;
+    memcpy(_ptResponse->u8ETag, tResult.u8ETag, tResult.u8ETagLen);
+
     //
-    // Copy payload if payload size is expected
+    // Payload was copied by the CoAP layer, check it was not cut
     //
-    if(_ptResponse->u16PayloadLen >= parsed->payload_len) {
-        _ptResponse->u16PayloadLen = parsed->payload_len;
-        _ptResponse->u16MsgId = parsed->msg_id;
-        _ptResponse->u16MsgCode = parsed->msg_code;
-        strcpy((char*)_ptResponse->pu8Payload, payload.c_str());
-        free(parsed);
+    if(_ptResponse->pu8Payload == NULL || _ptResponse->u16PayloadLen > tResult.u16PayloadLen) {
+        _ptResponse->u16PayloadLen = tResult.u16PayloadLen;
         return 0;
     }
     else {
         print_function("Payload size is too smaller! input:%d, response:%d\n", 
-                    _ptResponse->u16PayloadLen, parsed->payload_len);
-        free(parsed);
+                    _ptResponse->u16PayloadLen, tResult.u16PayloadLen);
         return -1;
     }
 }
 
-int SPlat_iGetSensorData(const char *_strDeviceId, const char *_strSensorId)
+// Read the latest rawdata of a sensor into _strJson
+static int SPlat_iGetSensorRaw(const char *_strDeviceId, const char *_strSensorId, char *_strJson, uint16_t _u16Size)
 {
     int iRet, i;
     unsigned int uiSize;
     TRecvResponse tResponse;
+    char cUriBuf[URI_BUF_SIZE];
 
     memset(&tResponse, 0, sizeof(TRecvResponse));
-    memset(g_cJsonBuf, 0, JSON_BUF_SIZE);
-    memset(g_cUriBuf, 0, URI_BUF_SIZE);
+    memset(_strJson, 0, _u16Size);
+    memset(cUriBuf, 0, URI_BUF_SIZE);
 
-    uiSize = snprintf(g_cUriBuf, 
+    uiSize = snprintf(cUriBuf, 
                         URI_BUF_SIZE, 
                         RESTFUL_API_GET_SENSOR_DATA, 
                         API_KEY, 
@@ -223,11 +435,8 @@ int SPlat_iGetSensorData(const char *_strDeviceId, const char *_strSensorId)
     }
     
     for(i=0; i<3; i++) {
-        coap_get(g_cUriBuf);
-        tResponse.u16PayloadLen = JSON_BUF_SIZE;
-        tResponse.pu8Payload = (uint8_t *)g_cJsonBuf;
-        iRet = SPlat_iRecvResponse(&tResponse);
-        if(iRet == 0 && tResponse.u16MsgId == 9)
+        iRet = SPlat_iCachedGet(cUriBuf, _strJson, _u16Size, &tResponse);
+        if(iRet == 0)
             break;
         print_function("[%d] Re-send packet to get data\n\r", i);
     }
@@ -239,9 +448,746 @@ int SPlat_iGetSensorData(const char *_strDeviceId, const char *_strSensorId)
     
 #if SPLAT_DEBUG
     print_function("Response success and payload as below\n");
-    print_function("%s\n", g_cJsonBuf);
+    print_function("%s\n", _strJson);
 #endif // SPLAT_DEBUG
 
     return 0;
 }
 
+int SPlat_iGetSensorData(const char *_strDeviceId, const char *_strSensorId)
+{
+    char cJsonBuf[JSON_BUF_SIZE];
+
+    return SPlat_iGetSensorRaw(_strDeviceId, _strSensorId, cJsonBuf, JSON_BUF_SIZE);
+}
+
+//
+// Read the numbers of a sensor's value array, e.g. {"value":["10","5","300"]},
+// returns how many were stored in _pfValues or -1
+//
+int SPlat_iGetSensorValues(const char *_strDeviceId, const char *_strSensorId, float *_pfValues, int _iNum)
+{
+    char cJsonBuf[JSON_BUF_SIZE];
+    char *pcCur, *pcEnd;
+    int iCnt = 0;
+
+    if(SPlat_iGetSensorRaw(_strDeviceId, _strSensorId, cJsonBuf, JSON_BUF_SIZE) != 0) {
+        return -1;
+    }
+
+    pcCur = strstr(cJsonBuf, "\"value\"");
+    if(pcCur == NULL || (pcCur = strchr(pcCur, '[')) == NULL) {
+        print_function("No value in sensor data!\n");
+        return -1;
+    }
+
+    pcCur++;
+    while(iCnt < _iNum) {
+        while(*pcCur == ' ' || *pcCur == '"' || *pcCur == ',') {
+            pcCur++;
+        }
+        if(*pcCur == ']' || *pcCur == '\0') {
+            break;
+        }
+        _pfValues[iCnt] = strtof(pcCur, &pcEnd);
+        if(pcEnd == pcCur) {
+            print_function("Sensor value is not a number!\n");
+            return -1;
+        }
+        pcCur = pcEnd;
+        iCnt++;
+    }
+
+    return iCnt;
+}
+
+//
+// Server time from the cloud's own arrival stamp: write the local clock to
+// the TIME_SYNC_SENSOR sensor and read it back. The stamp was taken between
+// sending the write and receiving its answer.
+//
+int SPlat_iTimeSync(const char *_strDeviceId)
+{
+    char cJsonBuf[JSON_BUF_SIZE];
+    char cUriBuf[URI_BUF_SIZE];
+    TRecvResponse tResponse;
+    uint64_t u64SentMs, u64RecvMs;
+    unsigned long ulTag;
+    int64_t i64ServerMs;
+    unsigned int uiSize;
+    char *pcCur;
+    int iTrans;
+
+    u64SentMs = Kernel::get_ms_count();
+    g_tTimeMutex.lock();
+    g_u64TimeTryMs = u64SentMs;
+    g_tTimeMutex.unlock();
+
+#if COAP_TRANSPORT_RECORD || COAP_TRANSPORT_REPLAY
+    // A replay must send what was recorded and read back its own tag, so count the syncs of this boot instead
+    static unsigned long ulSyncCnt = 0;
+    ulTag = ++ulSyncCnt;
+#else
+    ulTag = (unsigned long)u64SentMs;
+#endif // COAP_TRANSPORT_RECORD || COAP_TRANSPORT_REPLAY
+    snprintf(cJsonBuf, JSON_BUF_SIZE, JSON_CMD_WRITE_CLOCK, TIME_SYNC_SENSOR, ulTag);
+    tResponse.u16PayloadLen = 0;
+    tResponse.pu8Payload = NULL;
+    if(SPlat_iRecvResponse(SPlat_iPostRawData(_strDeviceId, cJsonBuf, SPLAT_POST_SINGLE), &tResponse) != 0
+        || (tResponse.u16MsgCode >> 5) != 2) {
+        print_function("Clock write failed!\n");
+        return -1;
+    }
+    u64RecvMs = Kernel::get_ms_count();
+
+    memset(cUriBuf, 0, URI_BUF_SIZE);
+    uiSize = snprintf(cUriBuf,
+                        URI_BUF_SIZE,
+                        RESTFUL_API_GET_SENSOR_DATA,
+                        API_KEY,
+                        _strDeviceId,
+                        TIME_SYNC_SENSOR);
+    if(uiSize >= URI_BUF_SIZE) {
+        print_function("Maybe buffer size of URI too small!\n\r");
+        return -1;
+    }
+
+    // Not through the cache, the stamp changes with every write
+    memset(cJsonBuf, 0, JSON_BUF_SIZE);
+    iTrans = coap_get(cUriBuf, (uint8_t *)cJsonBuf, JSON_BUF_SIZE);
+    tResponse.u16PayloadLen = JSON_BUF_SIZE;
+    tResponse.pu8Payload = (uint8_t *)cJsonBuf;
+    if(SPlat_iRecvResponse(iTrans, &tResponse) != 0 || tResponse.u16MsgCode != COAP_MSG_CODE_RESPONSE_CONTENT) {
+        print_function("Clock read failed!\n");
+        return -1;
+    }
+
+    // Another writer or an older write would carry the wrong stamp
+    pcCur = strstr(cJsonBuf, "\"value\"");
+    if(pcCur == NULL || (pcCur = strchr(pcCur, '[')) == NULL) {
+        print_function("No value in clock sensor data!\n");
+        return -1;
+    }
+    pcCur++;
+    while(*pcCur == ' ' || *pcCur == '"') {
+        pcCur++;
+    }
+    if(strtoul(pcCur, NULL, 10) != ulTag) {
+        print_function("Clock sensor does not hold our write!\n");
+        return -1;
+    }
+
+    pcCur = strstr(cJsonBuf, "\"time\"");
+    if(pcCur == NULL || (pcCur = strchr(pcCur + 6, '"')) == NULL || TimeSync_iParseIso(pcCur + 1, &i64ServerMs) != 0) {
+        print_function("No time in clock sensor data!\n");
+        return -1;
+    }
+
+    g_tTimeMutex.lock();
+    TimeSync_vSample(&g_tTimeSync, u64SentMs, u64RecvMs, i64ServerMs);
+    g_tTimeMutex.unlock();
+    return 0;
+}
+
+// Sync when the error bound or the age calls for it, a failed attempt is not repeated before TIME_SYNC_RETRY_SEC
+static void SPlat_vTimeSyncDue(const char *_strDeviceId)
+{
+    uint64_t u64NowMs = Kernel::get_ms_count();
+    int iDue;
+
+    g_tTimeMutex.lock();
+    iDue = TimeSync_iNeedSync(&g_tTimeSync, u64NowMs)
+            && (g_u64TimeTryMs == 0 || u64NowMs - g_u64TimeTryMs >= TIME_SYNC_RETRY_SEC * 1000ULL);
+    g_tTimeMutex.unlock();
+
+    if(iDue) {
+        SPlat_iTimeSync(_strDeviceId);
+    }
+}
+
+void SPlat_vTimeReport(void)
+{
+    g_tTimeMutex.lock();
+    TimeSync_vReport(&g_tTimeSync);
+    g_tTimeMutex.unlock();
+}
+
+//
+// Gateway mode: many downstream devices, each with its own serial number,
+// digest and cached device ID, share the socket and the CoAP transaction
+// table. Readings are queued per device and uploaded as one rawdata array.
+//
+int SPlat_iDeviceInit(TSPlatDevice *_ptDev, const char *_strDigest, const char *_strSN)
+{
+    if(strlen(_strDigest) >= SPLAT_DIGEST_LEN || strlen(_strSN) >= SPLAT_SN_LEN) {
+        print_function("Digest or serial number too long!\n\r");
+        return -1;
+    }
+
+    memset(_ptDev, 0, sizeof(TSPlatDevice));
+    strcpy(_ptDev->strDigest, _strDigest);
+    strcpy(_ptDev->strSN, _strSN);
+    return 0;
+}
+
+// Get the device ID, registering the device first if the cloud does not know it, then attach it to the gateway
+int SPlat_iDeviceOpen(TSPlatDevice *_ptDev)
+{
+    TSPlatDevice *ptIter;
+
+    if(_ptDev->strDeviceId[0] == '\0') {
+        if(SPlat_iGetDeviceId(_ptDev->strDigest, _ptDev->strSN, _ptDev->strDeviceId) != 0) {
+            if(SPlat_iRegister(_ptDev->strDigest, _ptDev->strSN) != 0) {
+                print_function("Register %s failed!\n", _ptDev->strSN);
+                return -1;
+            }
+            memset(_ptDev->strDeviceId, 0, SPLAT_DEVICE_ID_LEN);
+            if(SPlat_iGetDeviceId(_ptDev->strDigest, _ptDev->strSN, _ptDev->strDeviceId) != 0) {
+                memset(_ptDev->strDeviceId, 0, SPLAT_DEVICE_ID_LEN);
+                return -1;
+            }
+        }
+    }
+
+    g_tDeviceMutex.lock();
+    for(ptIter = g_ptDeviceList; ptIter != NULL; ptIter = ptIter->ptNext) {
+        if(ptIter == _ptDev) {
+            g_tDeviceMutex.unlock();
+            return 0;
+        }
+    }
+    _ptDev->ptNext = g_ptDeviceList;
+    g_ptDeviceList = _ptDev;
+    g_tDeviceMutex.unlock();
+
+    return 0;
+}
+
+// Waits for an upload of the device in flight, the caller may reuse it on return
+void SPlat_vDeviceClose(TSPlatDevice *_ptDev)
+{
+    TSPlatDevice **pptIter;
+
+    g_tDeviceMutex.lock();
+    while(_ptDev->iBusy) {
+        g_tDeviceMutex.unlock();
+        ThisThread::sleep_for(SPLAT_DEVICE_CLOSE_POLL_MS);
+        g_tDeviceMutex.lock();
+    }
+
+    for(pptIter = &g_ptDeviceList; *pptIter != NULL; pptIter = &(*pptIter)->ptNext) {
+        if(*pptIter == _ptDev) {
+            *pptIter = _ptDev->ptNext;
+            _ptDev->ptNext = NULL;
+            break;
+        }
+    }
+    g_tDeviceMutex.unlock();
+}
+
+// Mark the device as uploading, returns -1 when another flush has it already
+static int SPlat_iDeviceClaim(TSPlatDevice *_ptDev)
+{
+    int iRet = -1;
+
+    g_tDeviceMutex.lock();
+    if(!_ptDev->iBusy) {
+        _ptDev->iBusy = 1;
+        iRet = 0;
+    }
+    g_tDeviceMutex.unlock();
+    return iRet;
+}
+
+static void SPlat_vDeviceRelease(TSPlatDevice *_ptDev)
+{
+    g_tDeviceMutex.lock();
+    _ptDev->iBusy = 0;
+    g_tDeviceMutex.unlock();
+}
+
+//
+// Build a rawdata array of readings, returns its length or -1. Readings are
+// stamped with server time as the clock knows it now, so those taken before
+// the first sync or long ago get the best estimate too. Without a sync the
+// cloud stamps them on arrival.
+//
+static int SPlat_iBuildBatch(const TSPlatReading *_ptReadings, unsigned int _uiNum, char *_strJson, unsigned int _uiSize)
+{
+    unsigned int i, uiLen, uiSize;
+    char cIso[TIME_SYNC_ISO_LEN];
+    int64_t i64ServerMs;
+    int iTime;
+
+    uiLen = snprintf(_strJson, _uiSize, "[");
+    for(i = 0; i < _uiNum; i++) {
+        g_tTimeMutex.lock();
+        iTime = _ptReadings[i].u64LocalMs != 0
+                && TimeSync_iToServer(&g_tTimeSync, _ptReadings[i].u64LocalMs, &i64ServerMs, NULL) == 0;
+        g_tTimeMutex.unlock();
+
+        if(iTime && TimeSync_iFormatIso(i64ServerMs, cIso, sizeof(cIso)) == 0) {
+            uiSize = snprintf(_strJson + uiLen,
+                                _uiSize - uiLen,
+                                (i == 0) ? JSON_CMD_WRITE_SENSRO_ENTRY_TIME : "," JSON_CMD_WRITE_SENSRO_ENTRY_TIME,
+                                ID_STRING_TEMPERATURE,
+                                cIso,
+                                _ptReadings[i].fTemperature,
+                                ID_STRING_HUMIDITY,
+                                cIso,
+                                _ptReadings[i].u16Humidity);
+        }
+        else {
+            uiSize = snprintf(_strJson + uiLen,
+                                _uiSize - uiLen,
+                                (i == 0) ? JSON_CMD_WRITE_SENSRO_ENTRY : "," JSON_CMD_WRITE_SENSRO_ENTRY,
+                                ID_STRING_TEMPERATURE,
+                                _ptReadings[i].fTemperature,
+                                ID_STRING_HUMIDITY,
+                                _ptReadings[i].u16Humidity);
+        }
+        if(uiSize >= _uiSize - uiLen) {
+            print_function("Maybe buffer size of batch json too small!\n\r");
+            return -1;
+        }
+        uiLen += uiSize;
+    }
+    if(uiLen + 2 > _uiSize) {
+        print_function("Maybe buffer size of batch json too small!\n\r");
+        return -1;
+    }
+    strcpy(_strJson + uiLen, "]");
+
+    return uiLen + 1;
+}
+
+//
+// Build and post up to *_puiNum readings as a bulk upload. The batch is
+// halved while it does not fit the buffer or, on UDP, a datagram. Returns
+// the transaction or -1, *_puiNum is the number of readings posted.
+//
+static int SPlat_iPostBatch(const char *_strDeviceId, const TSPlatReading *_ptReadings, unsigned int *_puiNum, char *_strJson, unsigned int _uiSize)
+{
+    int iTrans;
+
+    while(*_puiNum > 0) {
+        if(SPlat_iBuildBatch(_ptReadings, *_puiNum, _strJson, _uiSize) >= 0) {
+            iTrans = SPlat_iPostRawData(_strDeviceId, _strJson, SPLAT_POST_BULK);
+            if(iTrans != COAP_ERR_TOO_LARGE) {
+                return iTrans;
+            }
+        }
+        *_puiNum /= 2;
+    }
+    return -1;
+}
+
+// Build the batched rawdata array in g_cBatchBuf and post it, the readings that did not fit stay queued.
+// The device is claimed, writes only append to it then, so the posted readings stay put.
+static int SPlat_iDevicePostBatch(TSPlatDevice *_ptDev)
+{
+    int iTrans;
+
+    g_tDeviceMutex.lock();
+    _ptDev->uiPostNum = _ptDev->uiBatchCnt;
+    g_tDeviceMutex.unlock();
+
+    g_tBatchMutex.lock();
+    iTrans = SPlat_iPostBatch(_ptDev->strDeviceId, _ptDev->tBatch, &_ptDev->uiPostNum, g_cBatchBuf, BATCH_JSON_BUF_SIZE);
+    g_tBatchMutex.unlock();
+    return iTrans;
+}
+
+// Upload readings of one device as rawdata arrays, split when they do not fit one. Returns 0 when all were stored.
+int SPlat_iWriteSensorBatch(const char *_strDeviceId, const TSPlatReading *_ptReadings, unsigned int _uiNum)
+{
+    TRecvResponse tResponse;
+    unsigned int uiDone = 0, uiNum;
+    char *pcJsonBuf;
+
+    // Callers may run in several threads, so no shared buffer
+    pcJsonBuf = (char *)malloc(SPLAT_BULK_JSON_BUF_SIZE);
+    if(pcJsonBuf == NULL) {
+        return -1;
+    }
+
+    while(uiDone < _uiNum) {
+        uiNum = _uiNum - uiDone;
+        tResponse.u16PayloadLen = 0;
+        tResponse.pu8Payload = NULL;
+        if(SPlat_iRecvResponse(SPlat_iPostBatch(_strDeviceId, &_ptReadings[uiDone], &uiNum, pcJsonBuf, SPLAT_BULK_JSON_BUF_SIZE), &tResponse) != 0
+            || (tResponse.u16MsgCode >> 5) != 2) {
+            break;
+        }
+        uiDone += uiNum;
+    }
+
+    if(uiDone > 0) {
+        SPlat_vCacheDropWritten(_strDeviceId);
+    }
+    free(pcJsonBuf);
+    return (uiDone >= _uiNum) ? 0 : -1;
+}
+
+static int SPlat_iDeviceWaitBatch(TSPlatDevice *_ptDev, int _iTrans)
+{
+    TRecvResponse tResponse;
+
+    tResponse.u16PayloadLen = 0;
+    tResponse.pu8Payload = NULL;
+    // Any 2.xx code means the readings were stored
+    if(SPlat_iRecvResponse(_iTrans, &tResponse) != 0 || (tResponse.u16MsgCode >> 5) != 2) {
+        g_tDeviceMutex.lock();
+        _ptDev->uiFailCnt++;
+        g_tDeviceMutex.unlock();
+        return -1;
+    }
+
+    // A split batch leaves the rest for the next upload
+    g_tDeviceMutex.lock();
+    _ptDev->uiBatchCnt -= _ptDev->uiPostNum;
+    memmove(&_ptDev->tBatch[0], &_ptDev->tBatch[_ptDev->uiPostNum], _ptDev->uiBatchCnt * sizeof(TSPlatReading));
+    _ptDev->uiUploadCnt++;
+    g_tDeviceMutex.unlock();
+
+    SPlat_vCacheDropWritten(_ptDev->strDeviceId);
+    return 0;
+}
+
+// Returns -1 also when a gateway flush is uploading the device already
+int SPlat_iDeviceFlush(TSPlatDevice *_ptDev)
+{
+    int iRet = 0;
+
+    if(SPlat_iDeviceClaim(_ptDev) != 0) {
+        return -1;
+    }
+
+    while(_ptDev->uiBatchCnt > 0) {
+        if(SPlat_iDeviceWaitBatch(_ptDev, SPlat_iDevicePostBatch(_ptDev)) != 0) {
+            iRet = -1;
+            break;
+        }
+    }
+
+    SPlat_vDeviceRelease(_ptDev);
+    return iRet;
+}
+
+int SPlat_iDeviceWrite(TSPlatDevice *_ptDev, float _fTempData, uint16_t _u16HumiData)
+{
+    if(_ptDev->uiBatchCnt >= SPLAT_BATCH_NUM) {
+        SPlat_iDeviceFlush(_ptDev);
+    }
+
+    g_tDeviceMutex.lock();
+    if(_ptDev->uiBatchCnt >= SPLAT_BATCH_NUM) {
+        // An upload in flight owns the oldest readings, drop the new one instead
+        if(_ptDev->iBusy) {
+            _ptDev->uiDropCnt++;
+            g_tDeviceMutex.unlock();
+            return -1;
+        }
+
+        // Upload failed, make room by dropping the oldest reading
+        memmove(&_ptDev->tBatch[0], &_ptDev->tBatch[1], (SPLAT_BATCH_NUM - 1) * sizeof(TSPlatReading));
+        _ptDev->uiBatchCnt--;
+        _ptDev->uiDropCnt++;
+    }
+
+    _ptDev->tBatch[_ptDev->uiBatchCnt].fTemperature = _fTempData;
+    _ptDev->tBatch[_ptDev->uiBatchCnt].u16Humidity = _u16HumiData;
+    _ptDev->tBatch[_ptDev->uiBatchCnt].u64LocalMs = Kernel::get_ms_count();
+    _ptDev->uiBatchCnt++;
+    g_tDeviceMutex.unlock();
+
+    return 0;
+}
+
+// Claim up to SPLAT_GATEWAY_WINDOW devices with queued readings not yet tried
+// in this round, so the uploads run with the list unlocked
+static int SPlat_iGatewaySnapshot(unsigned int _uiRound, TSPlatDevice **_pptWindow)
+{
+    TSPlatDevice *ptDev;
+    int iNum = 0;
+
+    g_tDeviceMutex.lock();
+    for(ptDev = g_ptDeviceList; ptDev != NULL && iNum < SPLAT_GATEWAY_WINDOW; ptDev = ptDev->ptNext) {
+        if(ptDev->uiRound == _uiRound || ptDev->iBusy || ptDev->uiBatchCnt == 0) {
+            continue;
+        }
+        ptDev->uiRound = _uiRound;
+        ptDev->iBusy = 1;
+        _pptWindow[iNum++] = ptDev;
+    }
+    g_tDeviceMutex.unlock();
+    return iNum;
+}
+
+// Upload the queued readings of every attached device, keeping up to
+// SPLAT_GATEWAY_WINDOW uploads in flight. Returns the number of failed devices.
+int SPlat_iGatewayFlush(void)
+{
+    TSPlatDevice *aptWindow[SPLAT_GATEWAY_WINDOW];
+    int aiTrans[SPLAT_GATEWAY_WINDOW];
+    char strClockId[SPLAT_DEVICE_ID_LEN] = "";
+    unsigned int uiRound;
+    int i, iNum, iFail = 0;
+
+    // Any attached device can carry the clock sensor, the gateway has one clock
+    g_tDeviceMutex.lock();
+    if(g_ptDeviceList != NULL) {
+        strcpy(strClockId, g_ptDeviceList->strDeviceId);
+    }
+    // Devices start at round 0, skip it when the counter wraps
+    if(++g_uiGatewayRound == 0) {
+        g_uiGatewayRound++;
+    }
+    uiRound = g_uiGatewayRound;
+    g_tDeviceMutex.unlock();
+
+    if(strClockId[0] != '\0') {
+        SPlat_vTimeSyncDue(strClockId);
+    }
+
+    while((iNum = SPlat_iGatewaySnapshot(uiRound, aptWindow)) > 0) {
+        for(i = 0; i < iNum; i++) {
+            aiTrans[i] = SPlat_iDevicePostBatch(aptWindow[i]);
+        }
+
+        for(i = 0; i < iNum; i++) {
+            if(SPlat_iDeviceWaitBatch(aptWindow[i], aiTrans[i]) != 0) {
+                iFail++;
+            }
+            SPlat_vDeviceRelease(aptWindow[i]);
+        }
+    }
+
+    return iFail;
+}
+
+//
+// Priority uplink. Alarm readings are posted from the caller at once, as
+// confirmable requests on their own transaction, so they never wait behind
+// routine traffic. Routine readings are queued and a sender thread posts
+// them as one rawdata array when a batch is waiting (SPLAT_BATCH_NUM, or
+// SPLAT_UPLINK_BATCH_NUM while bulk uploads go over TCP), when
+// the oldest has waited SPLAT_UPLINK_DELAY_SEC, or right after an alarm
+// while the radio is still awake. It holds back while an alarm is in flight.
+//
+static void SPlat_vUplinkRecord(int _iClass, uint64_t _u64QueuedMs, uint64_t _u64NowMs)
+{
+    TSPlatClassStats *ptStats = &g_tUplinkStats[_iClass];
+    uint32_t u32LatencyMs = (uint32_t)(_u64NowMs - _u64QueuedMs);
+
+    ptStats->uiSentCnt++;
+    ptStats->u32LastMs = u32LatencyMs;
+    ptStats->u64TotalMs += u32LatencyMs;
+    if(u32LatencyMs > ptStats->u32MaxMs) {
+        ptStats->u32MaxMs = u32LatencyMs;
+    }
+}
+
+// Readings per routine batch, the larger TCP batch only while that path is up
+static unsigned int SPlat_uiUplinkBatchNum(void)
+{
+    return coap_bulk_over_tcp() ? SPLAT_UPLINK_BATCH_NUM : SPLAT_BATCH_NUM;
+}
+
+// Post up to a batch of routine readings, returns how many were stored or -1
+static int SPlat_iUplinkFlush(void)
+{
+    TSPlatReading tBatch[SPLAT_UPLINK_BATCH_NUM];
+    unsigned int i, uiSeq, uiNum, uiMax;
+    TRecvResponse tResponse;
+    uint64_t u64NowMs;
+    int iRet;
+
+    uiMax = SPlat_uiUplinkBatchNum();
+    g_tUplinkMutex.lock();
+    uiSeq = g_uiUplinkHead;
+    uiNum = g_uiUplinkTail - g_uiUplinkHead;
+    if(uiNum > uiMax) {
+        uiNum = uiMax;
+    }
+    for(i = 0; i < uiNum; i++) {
+        tBatch[i] = g_tUplinkQueue[(uiSeq + i) % SPLAT_UPLINK_QUEUE_NUM];
+    }
+    g_tUplinkMutex.unlock();
+
+    if(uiNum == 0) {
+        return 0;
+    }
+    // Stamps are taken from the clock as it is when the batch is built
+    SPlat_vTimeSyncDue(g_strUplinkDeviceId);
+
+    tResponse.u16PayloadLen = 0;
+    tResponse.pu8Payload = NULL;
+    iRet = SPlat_iRecvResponse(SPlat_iPostBatch(g_strUplinkDeviceId, tBatch, &uiNum, g_cUplinkBuf, SPLAT_BULK_JSON_BUF_SIZE), &tResponse);
+    u64NowMs = Kernel::get_ms_count();
+
+    g_tUplinkMutex.lock();
+    if(iRet != 0 || (tResponse.u16MsgCode >> 5) != 2) {
+        g_tUplinkStats[SPLAT_CLASS_ROUTINE].uiFailCnt++;
+        g_tUplinkMutex.unlock();
+        return -1;
+    }
+    for(i = 0; i < uiNum; i++) {
+        SPlat_vUplinkRecord(SPLAT_CLASS_ROUTINE, tBatch[i].u64LocalMs, u64NowMs);
+    }
+    // Readings dropped meanwhile already moved the head past some of ours
+    if((int)(uiSeq + uiNum - g_uiUplinkHead) > 0) {
+        g_uiUplinkHead = uiSeq + uiNum;
+    }
+    g_tUplinkMutex.unlock();
+
+    SPlat_vCacheDropWritten(g_strUplinkDeviceId);
+
+    return (int)uiNum;
+}
+
+static void SPlat_vUplinkThread(void)
+{
+    uint64_t u64NowMs, u64RetryMs = 0, u64OldestMs;
+    unsigned int uiNum;
+    uint32_t u32Flags;
+    int iFlush, iSent;
+
+    while(1) {
+        u32Flags = g_tUplinkFlags.wait_any(SPLAT_UPLINK_FLAG_QUEUED | SPLAT_UPLINK_FLAG_WARM, 1000);
+        u64NowMs = Kernel::get_ms_count();
+
+        g_tUplinkMutex.lock();
+        uiNum = g_uiUplinkTail - g_uiUplinkHead;
+        u64OldestMs = g_tUplinkQueue[g_uiUplinkHead % SPLAT_UPLINK_QUEUE_NUM].u64LocalMs;
+        g_tUplinkMutex.unlock();
+
+        if(uiNum == 0 || g_iUplinkAlarmCnt > 0 || u64NowMs < u64RetryMs) {
+            continue;
+        }
+
+        iFlush = (uiNum >= SPlat_uiUplinkBatchNum())
+                || (u64NowMs - u64OldestMs >= SPLAT_UPLINK_DELAY_SEC * 1000ULL)
+                || (!(u32Flags & osFlagsError) && (u32Flags & SPLAT_UPLINK_FLAG_WARM));
+        if(!iFlush) {
+            continue;
+        }
+
+        iSent = SPlat_iUplinkFlush();
+        if(iSent < 0) {
+            u64RetryMs = Kernel::get_ms_count() + SPLAT_UPLINK_RETRY_SEC * 1000ULL;
+        }
+        else if(uiNum > (unsigned int)iSent) {
+            // More waiting, go on with the next batch
+            g_tUplinkFlags.set(SPLAT_UPLINK_FLAG_WARM);
+        }
+    }
+}
+
+int SPlat_iUplinkStart(const char *_strDeviceId)
+{
+    if(strlen(_strDeviceId) >= SPLAT_DEVICE_ID_LEN) {
+        print_function("Device ID too long!\n\r");
+        return -1;
+    }
+    if(g_ptUplinkThread != NULL) {
+        return 0;
+    }
+
+    strcpy(g_strUplinkDeviceId, _strDeviceId);
+    memset(g_tUplinkStats, 0, sizeof(g_tUplinkStats));
+    g_ptUplinkThread = new Thread(osPriorityNormal, SPLAT_UPLINK_STACK_SIZE);
+    g_ptUplinkThread->start(SPlat_vUplinkThread);
+    return 0;
+}
+
+int SPlat_iUplinkWrite(float _fTempData, uint16_t _u16HumiData, int _iClass)
+{
+    TSPlatReading tReading;
+    TRecvResponse tResponse;
+    char cJsonBuf[JSON_BUF_SIZE];
+    uint64_t u64QueuedMs = Kernel::get_ms_count();
+    unsigned int uiIdx;
+    int i, iRet = -1;
+
+    if(g_ptUplinkThread == NULL) {
+        return -1;
+    }
+
+    if(_iClass == SPLAT_CLASS_ROUTINE) {
+        g_tUplinkMutex.lock();
+        if(g_uiUplinkTail - g_uiUplinkHead >= SPLAT_UPLINK_QUEUE_NUM) {
+            // Cloud unreachable for a while, the oldest reading gives way
+            g_uiUplinkHead++;
+            g_tUplinkStats[SPLAT_CLASS_ROUTINE].uiDropCnt++;
+        }
+        uiIdx = g_uiUplinkTail % SPLAT_UPLINK_QUEUE_NUM;
+        g_tUplinkQueue[uiIdx].fTemperature = _fTempData;
+        g_tUplinkQueue[uiIdx].u16Humidity = _u16HumiData;
+        g_tUplinkQueue[uiIdx].u64LocalMs = u64QueuedMs;
+        g_uiUplinkTail++;
+        g_tUplinkMutex.unlock();
+
+        g_tUplinkFlags.set(SPLAT_UPLINK_FLAG_QUEUED);
+        return 0;
+    }
+
+    tReading.fTemperature = _fTempData;
+    tReading.u16Humidity = _u16HumiData;
+    tReading.u64LocalMs = u64QueuedMs;
+    if(SPlat_iBuildBatch(&tReading, 1, cJsonBuf, JSON_BUF_SIZE) < 0) {
+        return -1;
+    }
+
+    g_tUplinkMutex.lock();
+    g_iUplinkAlarmCnt++;
+    g_tUplinkMutex.unlock();
+
+    for(i = 0; i < SPLAT_ALARM_RETRY_CNT; i++) {
+        tResponse.u16PayloadLen = 0;
+        tResponse.pu8Payload = NULL;
+        if(SPlat_iRecvResponse(SPlat_iPostRawData(g_strUplinkDeviceId, cJsonBuf, SPLAT_POST_ALARM), &tResponse) == 0
+            && (tResponse.u16MsgCode >> 5) == 2) {
+            SPlat_vCacheDropWritten(g_strUplinkDeviceId);
+            iRet = 0;
+            break;
+        }
+        print_function("[%d] Re-send alarm\n\r", i);
+    }
+
+    g_tUplinkMutex.lock();
+    g_iUplinkAlarmCnt--;
+    if(iRet == 0) {
+        SPlat_vUplinkRecord(SPLAT_CLASS_ALARM, u64QueuedMs, Kernel::get_ms_count());
+    }
+    else {
+        g_tUplinkStats[SPLAT_CLASS_ALARM].uiFailCnt++;
+    }
+    g_tUplinkMutex.unlock();
+
+    // The radio is awake now, a good time for the routine backlog
+    g_tUplinkFlags.set(SPLAT_UPLINK_FLAG_WARM);
+    return iRet;
+}
+
+void SPlat_vUplinkReport(void)
+{
+    static const char *strClassName[SPLAT_CLASS_NUM] = { "alarm", "routine" };
+    TSPlatClassStats *ptStats;
+    int i;
+
+    g_tUplinkMutex.lock();
+    for(i = 0; i < SPLAT_CLASS_NUM; i++) {
+        ptStats = &g_tUplinkStats[i];
+        print_function("%-8s sent:%u fail:%u drop:%u last:%lu avg:%lu max:%lu ms\n",
+                    strClassName[i],
+                    ptStats->uiSentCnt,
+                    ptStats->uiFailCnt,
+                    ptStats->uiDropCnt,
+                    (unsigned long)ptStats->u32LastMs,
+                    (unsigned long)(ptStats->uiSentCnt ? ptStats->u64TotalMs / ptStats->uiSentCnt : 0),
+                    (unsigned long)ptStats->u32MaxMs);
+    }
+    print_function("Routine readings queued:%u\n", g_uiUplinkTail - g_uiUplinkHead);
+    g_tUplinkMutex.unlock();
+}
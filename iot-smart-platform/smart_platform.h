@@ -12,13 +12,57 @@ extern "C"
 #define JSON_BUF_SIZE   256
 #define URI_BUF_SIZE    128
 #define RECV_BUF_SIZE   1280
-#define TIMEOUT_SEC     30
+#define TIMEOUT_SEC     30      // Separate responses and TCP, retransmitted requests wait for their schedule
+
+// Gateway mode, see SPlat_iDeviceOpen
+#define SPLAT_SN_LEN            32
+#define SPLAT_DIGEST_LEN        64
+#define SPLAT_DEVICE_ID_LEN     16
+#define SPLAT_BATCH_NUM         8
+#define SPLAT_GATEWAY_WINDOW    4       // Uploads in flight at once, below COAP_TRANSACTION_NUM
+#define SPLAT_DEVICE_CLOSE_POLL_MS  50  // SPlat_vDeviceClose waiting for an upload in flight
+#define BATCH_JSON_BUF_SIZE     1280    // 8 readings with timestamps
+
+// How SPlat_iPostRawData sends
+#define SPLAT_POST_SINGLE       0
+#define SPLAT_POST_BULK         1
+#define SPLAT_POST_ALARM        2       // May use the reserved NSTART slot
+
+// Priority uplink, see SPlat_iUplinkStart
+#define SPLAT_CLASS_ALARM           0
+#define SPLAT_CLASS_ROUTINE         1
+#define SPLAT_CLASS_NUM             2
+#define SPLAT_UPLINK_QUEUE_NUM      32      // Routine readings kept while the cloud is unreachable
+#if COAP_TCP_BULK
+// One message on the TCP stream, no need to stay under a datagram. Used
+// only while the TCP path is up, see coap_bulk_over_tcp
+#define SPLAT_UPLINK_BATCH_NUM      (2 * SPLAT_BATCH_NUM)
+#define SPLAT_BULK_JSON_BUF_SIZE    (2 * BATCH_JSON_BUF_SIZE)
+#else
+#define SPLAT_UPLINK_BATCH_NUM      SPLAT_BATCH_NUM
+#define SPLAT_BULK_JSON_BUF_SIZE    BATCH_JSON_BUF_SIZE
+#endif // COAP_TCP_BULK
+#define SPLAT_UPLINK_DELAY_SEC      60      // Longest a routine reading waits for its batch
+#define SPLAT_UPLINK_RETRY_SEC      10
+// The flush nests a batch of readings, a time sync with its JSON and URI
+// buffers, float formatting and the CoAP builder, 2048 left no headroom
+#define SPLAT_UPLINK_STACK_SIZE     4096
+#define SPLAT_UPLINK_FLAG_QUEUED    0x1
+#define SPLAT_UPLINK_FLAG_WARM      0x2     // Radio just used, flush now
+#define SPLAT_ALARM_RETRY_CNT       3
+
+// Response cache for GETs, see SPlat_iCachedGet
+#define SPLAT_CACHE_NUM         4
+#define SPLAT_CACHE_PAYLOAD_SIZE JSON_BUF_SIZE
 
 
 #define JSON_CMD_REGISTER "{\"op\":\"Reconfigure\",\"digest\":\"%s\",\"authority\":\"device\"}"
 #define JSON_CMD_WRITE_TEMPERATURE_DATA "[{\"id\":\"temperature\",\"value\":[\"%d\"]}]"
 #define JSON_CMD_WRITE_HUMIDITY_DATA "[{\"id\":\"humidity\",\"value\":[\"%d\"]}]"
 #define JSON_CMD_WRITE_SENSRO_DATA "[{\"id\":\"%s\",\"value\":[\"%.2f\"]},{\"id\":\"%s\",\"value\":[\"%d\"]}]"
+#define JSON_CMD_WRITE_SENSRO_ENTRY "{\"id\":\"%s\",\"value\":[\"%.2f\"]},{\"id\":\"%s\",\"value\":[\"%d\"]}"
+#define JSON_CMD_WRITE_SENSRO_ENTRY_TIME "{\"id\":\"%s\",\"time\":\"%s\",\"value\":[\"%.2f\"]},{\"id\":\"%s\",\"time\":\"%s\",\"value\":[\"%d\"]}"
+#define JSON_CMD_WRITE_CLOCK "[{\"id\":\"%s\",\"value\":[\"%lu\"]}]"
 
 #define RESTFUL_API_REGISTER "/%s/iot/v1/registry/%s"
 #define RESTFUL_API_WRITE_SENSRO_DATA "/%s/iot/v1/device/%s/rawdata"
@@ -39,14 +83,77 @@ typedef struct _TRecvResponse{
     uint16_t u16MsgCode;
     uint16_t u16PayloadLen;
     uint8_t* pu8Payload;
+    uint32_t u32MaxAge;
+    uint8_t u8ETagLen;
+    uint8_t u8ETag[COAP_ETAG_MAX_LEN];
 }TRecvResponse;
 
+// Per class counters, latency runs from SPlat_iUplinkWrite to the cloud's answer
+typedef struct _TSPlatClassStats{
+    unsigned int uiSentCnt;
+    unsigned int uiFailCnt;
+    unsigned int uiDropCnt;
+    uint32_t u32LastMs;
+    uint32_t u32MaxMs;
+    uint64_t u64TotalMs;
+}TSPlatClassStats;
+
+typedef struct _TSPlatCacheEntry{
+    char strUri[URI_BUF_SIZE];      // Empty when unused
+    uint64_t u64ExpireMs;
+    uint64_t u64UsedMs;
+    uint8_t u8ETagLen;
+    uint8_t u8ETag[COAP_ETAG_MAX_LEN];
+    uint16_t u16PayloadLen;
+    char cPayload[SPLAT_CACHE_PAYLOAD_SIZE];
+}TSPlatCacheEntry;
+
+typedef struct _TSPlatReading{
+    float fTemperature;
+    uint16_t u16Humidity;
+    uint64_t u64LocalMs;        // Kernel::get_ms_count() when taken, 0 lets the cloud stamp it on arrival
+}TSPlatReading;
+
+// One downstream device served by the gateway, owned by the caller
+typedef struct _TSPlatDevice{
+    char strSN[SPLAT_SN_LEN];
+    char strDigest[SPLAT_DIGEST_LEN];
+    char strDeviceId[SPLAT_DEVICE_ID_LEN];
+    TSPlatReading tBatch[SPLAT_BATCH_NUM];
+    unsigned int uiBatchCnt;
+    unsigned int uiPostNum;     // Readings in the upload in flight, fewer than uiBatchCnt when split
+    unsigned int uiUploadCnt;
+    unsigned int uiFailCnt;
+    unsigned int uiDropCnt;
+    int iBusy;                  // Claimed by a flush, see SPlat_iDeviceClaim
+    unsigned int uiRound;       // Last SPlat_iGatewayFlush round that tried it
+    struct _TSPlatDevice *ptNext;
+}TSPlatDevice;
+
 int SPlat_iInit(void);
 int SPlat_iRegister(const char *_strDigest, const char *_strSN);
 int SPlat_iWriteSensorData(char *_strDeviceId, float _fTempData, uint16_t _u16HumiData);
-int SPlat_iRecvResponse(TRecvResponse *_ptResponse);
+int SPlat_iWriteSensorBatch(const char *_strDeviceId, const TSPlatReading *_ptReadings, unsigned int _uiNum);
+int SPlat_iRecvResponse(int _iTrans, TRecvResponse *_ptResponse);
 int SPlat_iGetDeviceId(const char *_strDigest, const char *_strSN, char *_strDeviceId);
 int SPlat_iGetSensorData(const char *_strDeviceId, const char *_strSensorId);
+int SPlat_iGetSensorValues(const char *_strDeviceId, const char *_strSensorId, float *_pfValues, int _iNum);
+void SPlat_vCacheDrop(const char *_strUri);
+void SPlat_vCacheFlush(void);
+void SPlat_vCacheReport(void);
+int SPlat_iTimeSync(const char *_strDeviceId);
+void SPlat_vTimeReport(void);
+
+int SPlat_iDeviceInit(TSPlatDevice *_ptDev, const char *_strDigest, const char *_strSN);
+int SPlat_iDeviceOpen(TSPlatDevice *_ptDev);
+void SPlat_vDeviceClose(TSPlatDevice *_ptDev);
+int SPlat_iDeviceWrite(TSPlatDevice *_ptDev, float _fTempData, uint16_t _u16HumiData);
+int SPlat_iDeviceFlush(TSPlatDevice *_ptDev);
+int SPlat_iGatewayFlush(void);
+
+int SPlat_iUplinkStart(const char *_strDeviceId);
+int SPlat_iUplinkWrite(float _fTempData, uint16_t _u16HumiData, int _iClass);
+void SPlat_vUplinkReport(void);
 
 #ifdef __cplusplus
 }
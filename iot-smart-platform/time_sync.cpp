@@ -0,0 +1,222 @@
+
+#include "mbed.h"
+#include <debug_print.h>
+#include <time_sync.h>
+
+void TimeSync_vInit(TTimeSync *_ptSync)
+{
+    memset(_ptSync, 0, sizeof(TTimeSync));
+}
+
+// Drift that may still be left in ppm, only the residual wander once the skew is corrected
+static uint32_t TimeSync_u32DriftPpm(const TTimeSync *_ptSync)
+{
+    return _ptSync->iSkewValid ? TIME_SYNC_RESIDUAL_PPM : TIME_SYNC_MAX_DRIFT_PPM;
+}
+
+static int64_t TimeSync_i64Project(const TTimeSync *_ptSync, uint64_t _u64LocalMs)
+{
+    int64_t i64DeltaMs = (int64_t)(_u64LocalMs - _ptSync->u64RefLocalMs);
+
+    return _ptSync->i64RefServerMs + i64DeltaMs + i64DeltaMs * _ptSync->i32SkewPpb / 1000000000LL;
+}
+
+static uint32_t TimeSync_u32ErrAt(const TTimeSync *_ptSync, uint64_t _u64LocalMs)
+{
+    uint64_t u64DistMs = (_u64LocalMs > _ptSync->u64RefLocalMs) ? _u64LocalMs - _ptSync->u64RefLocalMs : _ptSync->u64RefLocalMs - _u64LocalMs;
+
+    return _ptSync->u32RefErrMs + (uint32_t)(u64DistMs * TimeSync_u32DriftPpm(_ptSync) / 1000000);
+}
+
+static void TimeSync_vRestart(TTimeSync *_ptSync, uint64_t _u64LocalMs, int64_t _i64ServerMs, uint32_t _u32ErrMs)
+{
+    _ptSync->iSynced = 1;
+    _ptSync->iSkewValid = 0;
+    _ptSync->i32SkewPpb = 0;
+    _ptSync->u64RefLocalMs = _ptSync->u64AnchorLocalMs = _u64LocalMs;
+    _ptSync->i64RefServerMs = _ptSync->i64AnchorServerMs = _i64ServerMs;
+    _ptSync->u32RefErrMs = _ptSync->u32AnchorErrMs = _u32ErrMs;
+}
+
+//
+// Feed a server time that was read somewhere between _u64SentMs and
+// _u64RecvMs on the local clock. A sample that agrees with the model narrows
+// it to the overlap of both ranges; one that does not, e.g. after the
+// server's clock was stepped, restarts the model from the sample.
+//
+void TimeSync_vSample(TTimeSync *_ptSync, uint64_t _u64SentMs, uint64_t _u64RecvMs, int64_t _i64ServerMs)
+{
+    uint64_t u64LocalMs = _u64SentMs + (_u64RecvMs - _u64SentMs) / 2;
+    uint32_t u32ErrMs = (uint32_t)((_u64RecvMs - _u64SentMs + 1) / 2) + TIME_SYNC_RESOLUTION_MS;
+    int64_t i64PredictedMs, i64Lo, i64Hi, i64SpanMs, i64SkewPpb, i64SkewErrPpb;
+    uint32_t u32BoundMs;
+
+    _ptSync->uiSampleCnt++;
+    _ptSync->u64LastSampleMs = _u64RecvMs;
+
+    if(!_ptSync->iSynced) {
+        TimeSync_vRestart(_ptSync, u64LocalMs, _i64ServerMs, u32ErrMs);
+        print_function("Clock synced, error %lu ms\n", (unsigned long)u32ErrMs);
+        return;
+    }
+
+    i64PredictedMs = TimeSync_i64Project(_ptSync, u64LocalMs);
+    u32BoundMs = TimeSync_u32ErrAt(_ptSync, u64LocalMs);
+    i64Lo = (i64PredictedMs - u32BoundMs > _i64ServerMs - u32ErrMs) ? i64PredictedMs - u32BoundMs : _i64ServerMs - u32ErrMs;
+    i64Hi = (i64PredictedMs + u32BoundMs < _i64ServerMs + u32ErrMs) ? i64PredictedMs + u32BoundMs : _i64ServerMs + u32ErrMs;
+    if(i64Lo > i64Hi) {
+        print_function("Clock off by %ld ms, resync\n", (long)(_i64ServerMs - i64PredictedMs));
+        _ptSync->uiStepCnt++;
+        TimeSync_vRestart(_ptSync, u64LocalMs, _i64ServerMs, u32ErrMs);
+        return;
+    }
+
+    // Drift since the anchor, only once the span makes it more precise than the worst case
+    i64SpanMs = (int64_t)(u64LocalMs - _ptSync->u64AnchorLocalMs);
+    if(i64SpanMs >= TIME_SYNC_SKEW_MIN_SEC * 1000LL) {
+        i64SkewPpb = ((_i64ServerMs - _ptSync->i64AnchorServerMs) - i64SpanMs) * 1000000000LL / i64SpanMs;
+        i64SkewErrPpb = (int64_t)(u32ErrMs + _ptSync->u32AnchorErrMs) * 1000000000LL / i64SpanMs;
+        if(i64SkewErrPpb <= TIME_SYNC_MAX_DRIFT_PPM * 1000LL
+            && i64SkewPpb >= -TIME_SYNC_MAX_DRIFT_PPM * 1000LL && i64SkewPpb <= TIME_SYNC_MAX_DRIFT_PPM * 1000LL) {
+            _ptSync->i32SkewPpb = _ptSync->iSkewValid ? (int32_t)((_ptSync->i32SkewPpb + i64SkewPpb) / 2) : (int32_t)i64SkewPpb;
+            _ptSync->iSkewValid = 1;
+            _ptSync->u64AnchorLocalMs = u64LocalMs;
+            _ptSync->i64AnchorServerMs = _i64ServerMs;
+            _ptSync->u32AnchorErrMs = u32ErrMs;
+        }
+    }
+
+    _ptSync->u64RefLocalMs = u64LocalMs;
+    _ptSync->i64RefServerMs = i64Lo + (i64Hi - i64Lo) / 2;
+    _ptSync->u32RefErrMs = (uint32_t)((i64Hi - i64Lo + 1) / 2);
+}
+
+// Server time of a local clock reading, past or future, returns -1 before the first sample
+int TimeSync_iToServer(const TTimeSync *_ptSync, uint64_t _u64LocalMs, int64_t *_pi64ServerMs, uint32_t *_pu32ErrMs)
+{
+    if(!_ptSync->iSynced) {
+        return -1;
+    }
+
+    *_pi64ServerMs = TimeSync_i64Project(_ptSync, _u64LocalMs);
+    if(_pu32ErrMs != NULL) {
+        *_pu32ErrMs = TimeSync_u32ErrAt(_ptSync, _u64LocalMs);
+    }
+    return 0;
+}
+
+int TimeSync_iNeedSync(const TTimeSync *_ptSync, uint64_t _u64NowMs)
+{
+    uint64_t u64SinceMs = _u64NowMs - _ptSync->u64LastSampleMs;
+
+    if(!_ptSync->iSynced || u64SinceMs >= TIME_SYNC_SEC * 1000ULL) {
+        return 1;
+    }
+    // A slow link may never get below the limit, so not more often than TIME_SYNC_RETRY_SEC
+    return TimeSync_u32ErrAt(_ptSync, _u64NowMs) > TIME_SYNC_MAX_ERR_MS && u64SinceMs >= TIME_SYNC_RETRY_SEC * 1000ULL;
+}
+
+void TimeSync_vReport(const TTimeSync *_ptSync)
+{
+    char cIso[TIME_SYNC_ISO_LEN];
+    uint64_t u64NowMs = Kernel::get_ms_count();
+    int64_t i64ServerMs;
+    uint32_t u32ErrMs;
+
+    if(TimeSync_iToServer(_ptSync, u64NowMs, &i64ServerMs, &u32ErrMs) != 0) {
+        print_function("clock    not synced, samples:%u\n", _ptSync->uiSampleCnt);
+        return;
+    }
+    TimeSync_iFormatIso(i64ServerMs, cIso, sizeof(cIso));
+    print_function("clock    %s err:%lu ms skew:%.2f ppm%s samples:%u steps:%u\n",
+                cIso,
+                (unsigned long)u32ErrMs,
+                _ptSync->i32SkewPpb / 1000.0f,
+                _ptSync->iSkewValid ? "" : " (not measured)",
+                _ptSync->uiSampleCnt,
+                _ptSync->uiStepCnt);
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date
+static int64_t TimeSync_i64Days(int _iYear, unsigned int _uiMonth, unsigned int _uiDay)
+{
+    int iEra;
+    unsigned int uiYoe, uiDoy, uiDoe;
+
+    _iYear -= (_uiMonth <= 2);
+    iEra = (_iYear >= 0 ? _iYear : _iYear - 399) / 400;
+    uiYoe = (unsigned int)(_iYear - iEra * 400);
+    uiDoy = (153 * (_uiMonth > 2 ? _uiMonth - 3 : _uiMonth + 9) + 2) / 5 + _uiDay - 1;
+    uiDoe = uiYoe * 365 + uiYoe / 4 - uiYoe / 100 + uiDoy;
+    return (int64_t)iEra * 146097 + uiDoe - 719468;
+}
+
+// "2018-08-08T05:40:38.967Z" to Unix ms, the fraction and a "+hh:mm" offset instead of Z are optional
+int TimeSync_iParseIso(const char *_strIso, int64_t *_pi64Ms)
+{
+    int iYear, iMonth, iDay, iHour, iMin, iSec, iOfsHour, iOfsMin, iLen = 0;
+    int iMs = 0, iScale = 100;
+    const char *pcCur;
+    int64_t i64Ms;
+
+    if(sscanf(_strIso, "%4d-%2d-%2dT%2d:%2d:%2d%n", &iYear, &iMonth, &iDay, &iHour, &iMin, &iSec, &iLen) != 6 || iLen == 0) {
+        return -1;
+    }
+    if(iMonth < 1 || iMonth > 12 || iDay < 1 || iDay > 31 || iHour > 23 || iMin > 59 || iSec > 60) {
+        return -1;
+    }
+
+    pcCur = _strIso + iLen;
+    if(*pcCur == '.') {
+        for(pcCur++; *pcCur >= '0' && *pcCur <= '9'; pcCur++) {
+            iMs += (*pcCur - '0') * iScale;
+            iScale /= 10;
+        }
+    }
+
+    i64Ms = ((TimeSync_i64Days(iYear, iMonth, iDay) * 24 + iHour) * 60 + iMin) * 60 + iSec;
+    i64Ms = i64Ms * 1000 + iMs;
+
+    if(*pcCur == '+' || *pcCur == '-') {
+        if(sscanf(pcCur + 1, "%2d:%2d", &iOfsHour, &iOfsMin) != 2) {
+            return -1;
+        }
+        i64Ms += (*pcCur == '+' ? -1 : 1) * (iOfsHour * 60 + iOfsMin) * 60000LL;
+    }
+    else if(*pcCur != 'Z') {
+        return -1;
+    }
+
+    *_pi64Ms = i64Ms;
+    return 0;
+}
+
+int TimeSync_iFormatIso(int64_t _i64Ms, char *_strIso, unsigned int _uiSize)
+{
+    int64_t i64Days = (_i64Ms >= 0 ? _i64Ms : _i64Ms - 86399999) / 86400000;
+    uint32_t u32DayMs = (uint32_t)(_i64Ms - i64Days * 86400000);
+    int64_t i64Era;
+    unsigned int uiDoe, uiYoe, uiDoy, uiMp, uiDay, uiMonth;
+    int iYear;
+
+    // Inverse of TimeSync_i64Days
+    i64Days += 719468;
+    i64Era = (i64Days >= 0 ? i64Days : i64Days - 146096) / 146097;
+    uiDoe = (unsigned int)(i64Days - i64Era * 146097);
+    uiYoe = (uiDoe - uiDoe / 1460 + uiDoe / 36524 - uiDoe / 146096) / 365;
+    uiDoy = uiDoe - (365 * uiYoe + uiYoe / 4 - uiYoe / 100);
+    uiMp = (5 * uiDoy + 2) / 153;
+    uiDay = uiDoy - (153 * uiMp + 2) / 5 + 1;
+    uiMonth = (uiMp < 10) ? uiMp + 3 : uiMp - 9;
+    iYear = (int)(uiYoe + i64Era * 400) + (uiMonth <= 2);
+
+    if((unsigned int)snprintf(_strIso, _uiSize, "%04d-%02u-%02uT%02u:%02u:%02u.%03uZ",
+                iYear, uiMonth, uiDay,
+                (unsigned int)(u32DayMs / 3600000),
+                (unsigned int)(u32DayMs / 60000 % 60),
+                (unsigned int)(u32DayMs / 1000 % 60),
+                (unsigned int)(u32DayMs % 1000)) >= _uiSize) {
+        return -1;
+    }
+    return 0;
+}
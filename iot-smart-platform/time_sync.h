@@ -0,0 +1,65 @@
+#ifndef __TIME_SYNC_H__
+#define __TIME_SYNC_H__
+
+#include <mbed.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//
+// Device clock disciplined by server time. Readings are stamped with the
+// monotonic Kernel::get_ms_count() and mapped to server time (Unix ms) when
+// they are uploaded, so they may go late, batched or out of order. Each sync
+// sample is a server time known to lie between a local send and receive, it
+// fixes the offset to within half the round trip. Two samples at least
+// TIME_SYNC_SKEW_MIN_SEC apart measure the crystal's drift, which is then
+// corrected. The error bound grows with the distance from the last sample,
+// by TIME_SYNC_MAX_DRIFT_PPM until the drift is known and by
+// TIME_SYNC_RESIDUAL_PPM afterwards.
+//
+#ifndef TIME_SYNC_SEC
+#define TIME_SYNC_SEC               3600    // Longest time between sync samples
+#endif
+#ifndef TIME_SYNC_MAX_ERR_MS
+#define TIME_SYNC_MAX_ERR_MS        1000    // Sync again before the bound gets worse
+#endif
+
+#define TIME_SYNC_MAX_DRIFT_PPM     100
+#define TIME_SYNC_RESIDUAL_PPM      10
+#define TIME_SYNC_SKEW_MIN_SEC      600
+#define TIME_SYNC_RESOLUTION_MS     1       // Server stamps are in ms
+#define TIME_SYNC_RETRY_SEC         60
+#define TIME_SYNC_SENSOR            "clock" // Written and read back for the server's arrival stamp
+#define TIME_SYNC_ISO_LEN           25      // "2018-08-08T05:40:38.967Z" and the null
+
+typedef struct _TTimeSync{
+    int iSynced;
+    uint64_t u64RefLocalMs;     // Local clock at the reference sample
+    int64_t i64RefServerMs;     // Server time at the reference sample
+    uint32_t u32RefErrMs;       // Error bound at the reference sample
+    int iSkewValid;
+    int32_t i32SkewPpb;         // Server clock runs this much faster than ours
+    uint64_t u64AnchorLocalMs;  // Older sample the next drift measurement starts from
+    int64_t i64AnchorServerMs;
+    uint32_t u32AnchorErrMs;
+    uint64_t u64LastSampleMs;   // Local clock at the last sample
+    unsigned int uiSampleCnt;
+    unsigned int uiStepCnt;     // Samples that did not fit the model
+}TTimeSync;
+
+void TimeSync_vInit(TTimeSync *_ptSync);
+void TimeSync_vSample(TTimeSync *_ptSync, uint64_t _u64SentMs, uint64_t _u64RecvMs, int64_t _i64ServerMs);
+int TimeSync_iToServer(const TTimeSync *_ptSync, uint64_t _u64LocalMs, int64_t *_pi64ServerMs, uint32_t *_pu32ErrMs);
+int TimeSync_iNeedSync(const TTimeSync *_ptSync, uint64_t _u64NowMs);
+void TimeSync_vReport(const TTimeSync *_ptSync);
+
+int TimeSync_iParseIso(const char *_strIso, int64_t *_pi64Ms);
+int TimeSync_iFormatIso(int64_t _i64Ms, char *_strIso, unsigned int _uiSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // End of __TIME_SYNC_H__
@@ -1,21 +1,104 @@
 
 #include "mbed.h"
+#include <math.h>
+#include "i2c_bus.h"
 #include "hdc1050.h"
 #include "debug_print.h"
 #include "smart_platform.h"
+#include "adaptive_sampling.h"
+#if SPLAT_LOADGEN
+#include "load_generator.h"
+#endif // SPLAT_LOADGEN
+#if COAP_TRANSPORT_REPLAY
+#include "coap_transport.h"
+// Provides g_strCoapReplayTrace, a console log captured with COAP_TRANSPORT_RECORD=1
+#if defined(__has_include)
+#if !__has_include("coap_replay_trace.h")
+#error "COAP_TRANSPORT_REPLAY needs coap_replay_trace.h next to main.cpp, see Record and replay in README.md"
+#endif
+#endif
+#include "coap_replay_trace.h"
+#endif // COAP_TRANSPORT_REPLAY
 
 #define MAIN_RETRY_CNT 3
-#define SCHEDULE_TIME_SEC    10
+#define SCHEDULE_TIME_SEC    10     // Retry interval, readings follow the adaptive sampler
+#define MAIN_REPORT_CNT      60
+#define MAIN_ALARM_TEMPERATURE  40.0f   // Entering or leaving these is sent as an alarm
+#define MAIN_ALARM_HUMIDITY     90
 
 static DigitalOut g_tPower(CB_PWR_ON);
 
+// Pick up base period and bounds set from the cloud, see SAMPLE_CONFIG_SENSOR
+static void main_sampling_config(const char *_strDeviceId, TSampler *_ptSampler)
+{
+    float fConfig[3];
+    int i;
+
+    if(SPlat_iGetSensorValues(_strDeviceId, SAMPLE_CONFIG_SENSOR, fConfig, 3) != 3) {
+        print_function("No sampling config from cloud, keep %u s\n", _ptSampler->uiPeriodSec);
+        return;
+    }
+
+    // Casting NaN, negative or huge floats to unsigned is undefined, check them first
+    for(i = 0; i < 3; i++) {
+        if(!isfinite(fConfig[i]) || fConfig[i] < 1.0f || fConfig[i] > SAMPLE_LIMIT_SEC) {
+            print_function("Invalid sampling config from cloud, keep %u s\n", _ptSampler->uiPeriodSec);
+            return;
+        }
+    }
+    Sampler_iConfigure(_ptSampler, (unsigned int)fConfig[0], (unsigned int)fConfig[1], (unsigned int)fConfig[2]);
+}
+
+#if I2C_BUS_MOCK
+// NACKs up to the retry count must not reach the driver, more must fail the
+// read without leaving the bus stuck. Readings are the mock's 25 C and 55 %.
+static int main_i2c_selftest(void)
+{
+    float fTemperature;
+    uint16_t u16Humidity;
+
+    i2c_mock_inject_nack(TI_HDC1050_DEVICE_ADDR, I2C_BUS_RETRY_CNT);
+    if(HDC1050_GetSensorData(&fTemperature, &u16Humidity) != 0 || fabsf(fTemperature - 25.0f) > 0.1f || u16Humidity != 55) {
+        print_function("I2C self-test: read did not recover from %d NACKs!\n", I2C_BUS_RETRY_CNT);
+        return -1;
+    }
+
+    i2c_mock_inject_nack(TI_HDC1050_DEVICE_ADDR, I2C_BUS_RETRY_CNT + 1);
+    if(HDC1050_GetSensorData(&fTemperature, &u16Humidity) == 0) {
+        print_function("I2C self-test: read passed %d NACKs!\n", I2C_BUS_RETRY_CNT + 1);
+        return -1;
+    }
+    if(HDC1050_GetSensorData(&fTemperature, &u16Humidity) != 0) {
+        print_function("I2C self-test: read failed after the NACKs stopped!\n");
+        return -1;
+    }
+
+    print_function("I2C self-test passed\n");
+    i2c_bus_report();
+    return 0;
+}
+#endif // I2C_BUS_MOCK
+
+static void main_wait(int _iSec)
+{
+#if COAP_TRANSPORT_REPLAY
+    // Replay as fast as possible unless the original timing is wanted
+    if(!COAP_REPLAY_REALTIME) {
+        return;
+    }
+#endif // COAP_TRANSPORT_REPLAY
+    wait(_iSec);
+}
+
 int main()
 {
     char aDeviceId[16];
     int iRet, i, iNeedRegister;
-    unsigned int uiCnt = 0;
+    unsigned int uiCnt = 0, uiSeconds = 0, uiConfigSec = 0, uiPeriodSec;
+    int iAlarm = 0, iOver;
     float fTemperature = 0;
     uint16_t u16Humidity = 0;
+    TSampler tSampler;
 
     //
     // Initiation for board
@@ -23,9 +106,46 @@ int main()
     g_tPower = 1;
 
     //
-    // Initiation for hdc1050 sensor
+    // Initiation for sensor bus and hdc1050 sensor
     //
-    HDC1050_Init();
+#if I2C_BUS_MOCK
+    // Fixed readings of 25 C and 55 %, for boards without the sensor
+    i2c_mock_attach(TI_HDC1050_DEVICE_ADDR);
+    i2c_mock_set_reg(TI_HDC1050_DEVICE_ADDR, TI_HDC1050_MANUFACTURER_ID_ADDR, TI_HDC1050_MANUFACTURER_ID);
+    i2c_mock_set_reg(TI_HDC1050_DEVICE_ADDR, TI_HDC1050_DEVICE_ID_ADDR, TI_HDC1050_DEVICE_ID);
+    i2c_mock_set_reg(TI_HDC1050_DEVICE_ADDR, TI_HDC1050_TEMPERATURE_ADDR, 25817);
+    i2c_mock_set_reg(TI_HDC1050_DEVICE_ADDR, TI_HDC1050_HUMIDITY_ADDR, 36045);
+    iRet = i2c_bus_init(i2c_backend_mock());
+#else
+    iRet = i2c_bus_init(i2c_backend_mbed());
+#endif // I2C_BUS_MOCK
+    if(iRet != 0) {
+        print_function("Init I2C bus failed!\n");
+        return -1;
+    }
+    for(i=0; i < MAIN_RETRY_CNT; i++) {
+        if(HDC1050_Init() == 0) {
+            break;
+        }
+        if((i+1) >= MAIN_RETRY_CNT) {
+            print_function("Init HDC1050 sensor failed!\n");
+            return -1;
+        }
+        print_function("HDC1050 not found, retry\n");
+        main_wait(SCHEDULE_TIME_SEC);
+    }
+#if I2C_BUS_MOCK
+    if(main_i2c_selftest() != 0) {
+        return -1;
+    }
+#endif // I2C_BUS_MOCK
+
+#if COAP_TRANSPORT_REPLAY
+    if(coap_replay_load(g_strCoapReplayTrace, COAP_REPLAY_REALTIME) != 0) {
+        print_function("Load replay trace failed!\n");
+        return -1;
+    }
+#endif // COAP_TRANSPORT_REPLAY
 
     //
     // Initiation for APIs of IoT smart platform
@@ -36,6 +156,13 @@ int main()
         return -1;
     }
 
+#if SPLAT_LOADGEN
+    //
+    // Simulate a fleet of nodes instead of running this one
+    //
+    return LoadGen_iRun();
+#endif // SPLAT_LOADGEN
+
     //
     // Get device ID if we have already done with registration
     //
@@ -50,7 +177,7 @@ int main()
             print_function("Not found device ID from cloud or something wrong with networking.\n");
             iNeedRegister = 1;
         }
-        wait(SCHEDULE_TIME_SEC);
+        main_wait(SCHEDULE_TIME_SEC);
     }
 
     //
@@ -68,7 +195,7 @@ int main()
             print_function("Register to cloud failed!\n");
             return -1;
         }
-        wait(SCHEDULE_TIME_SEC);
+        main_wait(SCHEDULE_TIME_SEC);
     }
 
     //
@@ -85,24 +212,63 @@ int main()
                 print_function("Not get device ID and exit the program\n");
                 return -1;
             }
-            wait(SCHEDULE_TIME_SEC);
+            main_wait(SCHEDULE_TIME_SEC);
         }
     }
 
     print_function("Get Device ID :%s from cloud\n", aDeviceId);
 
     //
-    // Update sensor data to cloud
+    // Update sensor data to cloud, sampling faster while readings change
     //
+    Sampler_vInit(&tSampler);
+    if(SPlat_iUplinkStart(aDeviceId) != 0) {
+        return -1;
+    }
     while(1) 
     {
-        print_function("========== Cnt:%d, Seconds:%d ==========\n", uiCnt, uiCnt*SCHEDULE_TIME_SEC);
-        HDC1050_GetSensorData(&fTemperature, &u16Humidity);
-        print_function("Temperature:%.2f, Humidity:%d\n\r", fTemperature, u16Humidity);
-        SPlat_iWriteSensorData(aDeviceId, fTemperature, u16Humidity);
+        if(uiSeconds >= uiConfigSec) {
+            main_sampling_config(aDeviceId, &tSampler);
+            uiConfigSec = uiSeconds + SAMPLE_CONFIG_SEC;
+        }
+
+        print_function("========== Cnt:%d, Seconds:%d ==========\n", uiCnt, uiSeconds);
+        if(HDC1050_GetSensorData(&fTemperature, &u16Humidity) == 0) {
+            print_function("Temperature:%.2f, Humidity:%d\n\r", fTemperature, u16Humidity);
+            iOver = (fTemperature > MAIN_ALARM_TEMPERATURE || u16Humidity > MAIN_ALARM_HUMIDITY);
+            if(iOver != iAlarm) {
+                print_function("Alarm %s\n", iOver ? "raised" : "cleared");
+                iAlarm = iOver;
+                SPlat_iUplinkWrite(fTemperature, u16Humidity, SPLAT_CLASS_ALARM);
+            }
+            else {
+                SPlat_iUplinkWrite(fTemperature, u16Humidity, SPLAT_CLASS_ROUTINE);
+            }
+            uiPeriodSec = Sampler_uiUpdate(&tSampler, fTemperature, u16Humidity);
+        }
+        else {
+            uiPeriodSec = tSampler.uiPeriodSec;
+        }
+        if(uiCnt % MAIN_REPORT_CNT == 0) {
+            i2c_bus_report();
+            SPlat_vCacheReport();
+            SPlat_vUplinkReport();
+            coap_path_report();
+            SPlat_vTimeReport();
+            coap_mem_report();
+        }
+        print_function("Next reading in %u s\n", uiPeriodSec);
         print_function("\n\n");
 
-        wait(SCHEDULE_TIME_SEC);
+#if COAP_TRANSPORT_REPLAY
+        if(coap_replay_done()) {
+            coap_replay_report();
+            break;
+        }
+#endif // COAP_TRANSPORT_REPLAY
+
+        main_wait(uiPeriodSec);
+        uiSeconds += uiPeriodSec;
         uiCnt++;
     }
 